@@ -1,4 +1,5 @@
 #include <random>
+#include <chrono>
 #include <cmath>
 #include <vector>
 #include <stdexcept>
@@ -84,7 +85,7 @@ int main (int argc, char* argv[])
 
 
     auto image_char = load_pgm(image_filename);
-    auto image_short = TG::convert_image_to_unsigned_short<unsigned char, unsigned short>(image_char);
+    auto image_short = TG::rescale<unsigned short>(image_char);
 
 
 
@@ -94,11 +95,39 @@ int main (int argc, char* argv[])
     std::cout << "Displaying converted image:\n";
     TG::imshow(image_short, 0, 65535);
 
+    std::cout << "Displaying converted image, windowed between its 1st & 99th percentiles:\n";
+    TG::imshow(image_short, TG::auto_window(image_short));
+
     int block_size = 35;
     auto binary_image = TG::adaptive_threshold_blockwise(image_char, block_size);
 
     std::cout << "Displaying binary thresholded image:\n";
     TG::imshow(binary_image, 0, 255);
+
+    std::cout << "Displaying thresholded image cleaned up by morphological opening:\n";
+    const auto opened_image = TG::opening(binary_image, 3);
+    TG::imshow(opened_image, 0, 255);
+
+    const auto distance_map = TG::distance_transform(opened_image);
+    const auto distance_stats = TG::compute_statistics(distance_map);
+    std::cout << std::format("Displaying distance from background (up to {:.1f} pixels):\n", distance_stats.max);
+    TG::imshow(distance_map, 0, distance_stats.max, TG::hot());
+
+    // binary masks are compact when run-length encoded, and can be
+    // displayed and cropped directly from their runs:
+    TG::RLEImage binary_mask (binary_image);
+    std::cout << "Displaying run-length encoded mask (" << binary_mask.runs().size() << " runs), and its top-left quadrant:\n";
+    TG::imshow(binary_mask, 0, 255);
+    TG::imshow(binary_mask.crop(0, 0, binary_mask.width()/2, binary_mask.height()/2), 0, 255);
+
+    auto sauvola_image = TG::threshold_sauvola(image_char, block_size);
+    std::cout << "Displaying Sauvola thresholded image:\n";
+    TG::imshow(sauvola_image, 0, 255);
+
+    const auto tissue_thresholds = TG::compute_multi_otsu_thresholds(TG::histogramize<unsigned char>(image_char), 4);
+    std::cout << "Displaying 4-class multi-level Otsu segmentation:\n";
+    TG::imshow(TG::apply_thresholds(image_char, tissue_thresholds), 0, 3, TG::jet());
+
     // demonstate use of TG::plot():
     int kernel_size = 5; // Must be odd
     double sigma = 1.0;
@@ -107,6 +136,15 @@ int main (int argc, char* argv[])
     std::cout << "Displaying Gaussian filtered image:\n";
     TG::imshow(smoothed_image, 0, 255);
 
+    std::cout << "Displaying 5x5 median filtered image:\n";
+    TG::imshow(TG::median_filter(image, 5), 0, 255);
+
+    std::cout << "Displaying edge-preserving bilateral filtered image:\n";
+    TG::imshow(TG::bilateral_filter(image, 3.0, 20.0), 0, 255);
+
+    std::cout << "Displaying CLAHE contrast-enhanced image:\n";
+    TG::imshow(TG::clahe(image, 2.0, 4, 4), 0, 255);
+
     std::cout << "Displaying original image:\n";
     TG::imshow(image, 0, 255);
 
@@ -122,26 +160,66 @@ int main (int argc, char* argv[])
     std::cout << "Displaying edge-detected image using Sobel-X filter:\n";
     TG::imshow(edge_image, 0, 255);
 
+    const auto gradient = TG::compute_gradient(image);
+    std::cout << "Displaying Sobel gradient magnitude:\n";
+    TG::imshow(gradient.magnitude, TG::auto_window(gradient.magnitude));
+
+    std::cout << "Displaying Canny edges:\n";
+    const auto edges = TG::canny(image, 20, 60);
+    TG::imshow(edges, 0, 255);
+
+    const auto edge_segments = TG::connected_components(edges);
+    const auto longest = std::ranges::max_element(edge_segments.components, {}, &TG::Component::area);
+    std::cout << std::format("Displaying {} connected edge segments (largest: {} pixels, spanning {} x {}):\n",
+        edge_segments.components.size(), longest->area,
+        longest->x_max - longest->x_min + 1, longest->y_max - longest->y_min + 1);
+    TG::imshow(TG::wrap_labels(edge_segments.labels), TG::label_colours());
+
     // Run-Length Encoding
     auto encoded_data = TG::run_length_encode(image);
     std::cout << "Image encoded using Run-Length Encoding\n";
     
     // Save to file
     const std::string encoded_filename = "encoded_image.rle";
-    TG::save_encoded_to_file(encoded_data, encoded_filename);
+    TG::save_encoded_to_file(encoded_data, image.width(), image.height(), encoded_filename);
     std::cout << "Encoded data saved to file: " << encoded_filename << "\n";
     
-    // Load encoded data from file
-    auto loaded_encoded_data = TG::load_encoded_from_file<unsigned char>(encoded_filename);
-    std::cout << "Encoded data loaded from file\n";
-    
-    // Decode the image
-    auto decoded_image = TG::run_length_decode(loaded_encoded_data, image.width(), image.height());
+    // Load encoded data from file - the file records the image dimensions
+    // and pixel type, so these need not be known in advance
+    const auto info = TG::read_rle_file_info(encoded_filename);
+    auto decoded_image = TG::load_rle<unsigned char>(encoded_filename);
+    std::cout << "Encoded data loaded from file: " << info.width << " x " << info.height
+              << ", " << info.pixel_type << " pixels\n";
     std::cout << "Decoded image constructed\n";
 
     std::cout << "Displaying decoded image:\n";
     TG::imshow(decoded_image, 0, 255);
 
+    // compare run-length encoding against the tiled predictive codec, which
+    // suits greyscale content far better:
+    auto time_ms = [] (auto&& func) {
+      constexpr int repeats = 100;
+      const auto start = std::chrono::steady_clock::now();
+      for (int n = 0; n < repeats; ++n)
+        func();
+      return std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now() - start).count() / repeats;
+    };
+    const TG::CompressedImage compressed_image (image);
+    const bool lossless = std::ranges::equal (std::span (compressed_image.decode().data(), image.width()*image.height()),
+                                              std::span (image.data(), image.width()*image.height()));
+    std::cout << std::format ("Raw image: {} bytes\n", image.width()*image.height());
+    std::cout << std::format ("Run-length encoded: {} runs ({} bytes in file), encoded in {:.3f} ms, decoded in {:.3f} ms\n",
+        encoded_data.size(), std::ifstream (encoded_filename, std::ios::binary | std::ios::ate).tellg(),
+        time_ms ([&] { TG::run_length_encode (image); }),
+        time_ms ([&] { TG::run_length_decode (encoded_data, image.width(), image.height()); }));
+    std::cout << std::format ("Tiled lossless codec: {} bytes, encoded in {:.3f} ms, decoded in {:.3f} ms ({})\n",
+        compressed_image.bytes().size(),
+        time_ms ([&] { const TG::CompressedImage compressed (image); }),
+        time_ms ([&] { compressed_image.decode(); }),
+        lossless ? "lossless" : "MISMATCH");
+    std::cout << "Displaying top-left tile, decoded on demand:\n";
+    TG::imshow(compressed_image.decode_tile(0, 0), 0, 255);
+
     auto polar_image = TG::cartesian_to_polar(image);
     std::cout << "Image converted to Polar coordinates with Gaussian filtering\n";
     
@@ -155,6 +233,39 @@ int main (int argc, char* argv[])
     std::cout << "Displaying reconstructed Cartesian image:\n";
     TG::imshow(reconstructed_image, 0, 255);
 
+    // a transform with finer sampling can be reused for any number of
+    // images of the same size, without recomputing its coordinate maps:
+    const TG::PolarTransform fine_polar (image.width(), image.height(), 720, image.width());
+    std::cout << "Displaying reconstruction from unsmoothed polar image at 0.5 degree resolution:\n";
+    TG::imshow(fine_polar.to_cartesian(fine_polar.to_polar(image)), 0, 255);
+
+    // stack the image into a synthetic volume, cut to a sphere:
+    const int depth = 64;
+    TG::Volume<unsigned char> volume (image.width(), image.height(), depth);
+    for (int z = 0; z < depth; ++z) {
+      const double dz = (z - depth/2.0) / (depth/2.0);
+      const double radius2 = (1.0 - dz*dz) * image.width() * image.width() / 4.0;
+      for (int y = 0; y < image.height(); ++y)
+        for (int x = 0; x < image.width(); ++x) {
+          const double dx = x - image.width()/2.0, dy = y - image.height()/2.0;
+          volume(x, y, z) = dx*dx + dy*dy <= radius2 ? image(x, y) : 0;
+        }
+    }
+
+    // slices are views into the volume, so displaying them copies nothing:
+    std::cout << "Displaying axial, coronal & sagittal slices through synthetic volume:\n";
+    TG::imshow(volume.slice(TG::Orientation::AXIAL, depth/2), 0, 255);
+    TG::imshow(volume.slice(TG::Orientation::CORONAL, volume.height()/2), 0, 255);
+    TG::imshow(volume.slice(TG::Orientation::SAGITTAL, volume.width()/2), 0, 255);
+
+    // all slices at half resolution, as a single image with a single palette:
+    std::cout << std::format("Displaying montage of all {} axial slices:\n", depth);
+    TG::imshow(TG::montage(volume, TG::Orientation::AXIAL, 2), 0, 255);
+
+    std::cout << "Displaying maximum & mean intensity projections across coronal slices:\n";
+    TG::imshow(TG::maximum_intensity_projection(volume, TG::Orientation::CORONAL), 0, 255);
+    TG::imshow(TG::mean_intensity_projection(volume, TG::Orientation::CORONAL), 0, 255);
+
     std::vector<float> x (50);
     std::vector<float> y (50);
 
@@ -201,6 +312,14 @@ int main (int argc, char* argv[])
       .set_grid (50, 2)
       .add_line (noise,2);
 
+    // finally, play through the axial slices, encoding upcoming slices in
+    // the background while each is displayed at the top of the screen -
+    // this is done last, as the screen is cleared first:
+    std::cout << TG::Clear;
+    const auto playback = TG::Player(30.0).play(volume, TG::Orientation::AXIAL, 0, 255);
+    std::cout << std::format("Played {} axial slices ({} dropped) at {:.1f} fps, encoded in {:.1f} ms on average\n",
+        playback.frames_shown, playback.frames_dropped, playback.frame_rate, playback.mean_encode_ms);
+
   }
   catch (std::exception& e) {
     std::cerr << "error: " << e.what() << std::endl;
@@ -34,6 +34,33 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <optional>
+#include <bit>
+#include <type_traits>
+#include <tuple>
+#include <thread>
+#include <map>
+#include <mutex>
+#include <new>
+#include <initializer_list>
+#include <complex>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+#include <numeric>
+#include <fstream>
+#include <cstring>
+#include <span>
+#include <chrono>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 /**
  * \mainpage
@@ -137,6 +164,14 @@ namespace TG {
   //! convenience function to generate a ready-made jet colourmap
   ColourMap jet (int number = 101);
 
+  //! convenience function to generate a colourmap for label images
+  /**
+   * Index 0 (background) is black, and the remaining indices are distinct
+   * colours, with successive indices well separated in hue. See
+   * wrap_labels() to display label images with more labels than colours.
+   */
+  ColourMap label_colours (int number = 64);
+
 
 
   //! VT100 code to set the cursor position to the top left of the screen
@@ -163,6 +198,26 @@ namespace TG {
    */
   constexpr std::string_view Clear = "\033[2J";
 
+
+
+  //! Set the number of threads used by the image processing routines
+  /**
+   * Processing is shared between the calling thread & a pool of persistent
+   * worker threads. Setting `num_threads` to 1 disables multi-threading,
+   * while values <= 0 revert to the default: the value of the
+   * `TG_NUM_THREADS` environment variable if set, or the number of hardware
+   * threads otherwise.
+   *
+   * Work is split into chunks according to the size of the image alone, so
+   * results do not depend on the number of threads. Small images are
+   * processed serially on the calling thread.
+   */
+  void set_num_threads (int num_threads);
+
+  //! Query the number of threads used by the image processing routines
+  /** \sa set_num_threads() */
+  int get_num_threads ();
+
   //! A simple class to hold a 2D image using datatype specified as `ValueType` template parameter
   template <typename ValueType>
     class Image {
@@ -182,14 +237,134 @@ namespace TG {
         //! clear image, setting all intensities to 0
         void clear ();
 
+        //! direct access to the pixel data
+        /** Pixels are stored contiguously in row-major order, so that the
+         * intensity at (x,y) is found at offset `x + width()*y`. */
+        ValueType* data ();
+        const ValueType* data () const;
+
       private:
-        std::vector<ValueType> data;
+        std::vector<ValueType> buffer;
         const int x_dim, y_dim;
     };
 
+  //! Orientation of a slice through a Volume, or of the axis of a projection
+  /**
+   * AXIAL slices are perpendicular to the z axis, CORONAL slices to the y
+   * axis, and SAGITTAL slices to the x axis.
+   */
+  enum class Orientation { AXIAL, CORONAL, SAGITTAL };
+
+  template <typename ValueType> class VolumeSlice;
+
+  //! A simple class to hold a 3D volume using datatype specified as `ValueType` template parameter
+  /**
+   * Voxels are stored contiguously, with x varying fastest and z slowest,
+   * either in memory allocated by the volume itself, or in a memory-mapped
+   * file - see map_volume().
+   *
+   * Slices through the volume can be obtained using slice(): these refer
+   * directly to the voxel data without copying them, and can be passed to
+   * imshow() as any other image.
+   */
+  template <typename ValueType>
+    class Volume {
+      public:
+        //! Instantiate a Volume with the specified dimensions, with all intensities set to 0
+        Volume (int x_dim, int y_dim, int z_dim);
+
+        //! query volume dimensions
+        int width () const { return x_dim; }
+        int height () const { return y_dim; }
+        int depth () const { return z_dim; }
+
+        //! query or set intensity at coordinates (x,y,z)
+        ValueType& operator() (int x, int y, int z) { return data()[x + x_dim*( y + std::size_t (y_dim)*z )]; }
+        //! query intensity at coordinates (x,y,z)
+        const ValueType& operator() (int x, int y, int z) const { return data()[x + x_dim*( y + std::size_t (y_dim)*z )]; }
+
+        //! direct access to the voxel data
+        /** Voxels are stored contiguously, so that the intensity at (x,y,z)
+         * is found at offset `x + width()*(y + height()*z)`. */
+        ValueType* data () { return mapped ? mapped.get() : buffer.data(); }
+        const ValueType* data () const { return mapped ? mapped.get() : buffer.data(); }
+
+        //! a view of slice `index` in the orientation given, without copying the data
+        /** The slice remains valid for as long as the volume exists.
+         * \sa VolumeSlice */
+        VolumeSlice<ValueType> slice (Orientation orientation, int index) const;
+
+      private:
+        std::vector<ValueType> buffer;
+        std::shared_ptr<ValueType> mapped;
+        int x_dim, y_dim, z_dim;
+
+        template <typename T>
+          friend Volume<T> map_volume (const std::string& filename, int x_dim, int y_dim, int z_dim, std::size_t offset);
+    };
+
+  //! Map a volume stored as raw voxel data in a file
+  /**
+   * The voxels are expected in native byte order, in the same order as held
+   * in Volume, starting `offset` bytes into the file. The file is mapped
+   * into memory where supported (copy-on-write, so that any changes made to
+   * the volume do not affect the file), so that only the parts of the file
+   * actually accessed are read. Otherwise, or if `offset` is not a multiple
+   * of the alignment of T, the file is read into memory.
+   *
+   * Copies of a mapped volume share the same mapping, so that changes made
+   * to one are seen in all others. In contrast, copies of volumes held in
+   * memory (including those read from file) are independent, deep copies.
+   */
+  template <typename T>
+    Volume<T> map_volume (const std::string& filename, int x_dim, int y_dim, int z_dim, std::size_t offset = 0);
+
+  //! A slice through a Volume, usable as a 2D image without copying the data
+  /**
+   * AXIAL slices are `width()` x `height()` of the volume, CORONAL slices
+   * `width()` x `depth()`, and SAGITTAL slices `height()` x `depth()`, with
+   * z increasing down the rows of coronal & sagittal slices.
+   */
+  template <typename ValueType>
+    class VolumeSlice {
+      public:
+        VolumeSlice (const Volume<ValueType>& volume, Orientation orientation, int index);
+
+        int width () const { return x_dim; }
+        int height () const { return y_dim; }
+        const ValueType& operator() (int x, int y) const { return origin[x*x_stride + y*y_stride]; }
+
+      private:
+        const ValueType* origin;
+        std::ptrdiff_t x_stride, y_stride;
+        int x_dim, y_dim;
+    };
+
+  //! Maximum intensity projection of a volume along the axis perpendicular to the orientation given
+  /** The projection has the dimensions of a slice in that orientation, and
+   * is computed in parallel. */
+  template <typename T>
+    Image<T> maximum_intensity_projection (const Volume<T>& volume, Orientation orientation = Orientation::AXIAL);
+
+  //! Mean intensity projection of a volume along the axis perpendicular to the orientation given
+  /** As for maximum_intensity_projection(), but averaging the intensities. */
+  template <typename T>
+    Image<float> mean_intensity_projection (const Volume<T>& volume, Orientation orientation = Orientation::AXIAL);
+
 
 
 
+  //! Images that can provide the runs of identical values making up each row
+  /**
+   * `row_runs (y)` must return a range of (value, count) pairs covering
+   * row `y` - see RLEImage. imshow() encodes such images directly from their
+   * runs.
+   */
+  template <class ImageType>
+    concept HasRowRuns = requires (const ImageType& image) {
+      { image.row_runs (0) } -> std::ranges::range;
+    };
+
   //! Adapter class to rescale intensities of image to colourmap indices
   /**
    * Rescale intensities of image from (min, max) to the range of indices
@@ -204,6 +379,7 @@ namespace TG {
         int width () const;
         int height () const;
         ctype operator() (int x, int y) const;
+        std::vector<std::pair<ctype,int>> row_runs (int y) const requires HasRowRuns<ImageType>;
 
         unsigned short getUShortValue(int x, int y) const;
 
@@ -230,36 +406,62 @@ namespace TG {
   }
 
 
-  // if input in unsigned char but the output should be unsignged short
-  // call funciton manipulate in the pixel 
-  template <typename SourceType, typename TargetType>
-  TG::Image<TargetType> convert_image_to_unsigned_short(const TG::Image<SourceType>& input_image) {
-    SourceType min_val = std::numeric_limits<SourceType>::max();
-    SourceType max_val = std::numeric_limits<SourceType>::min();
+  //! Summary statistics of the intensities in an image
+  /**
+   * NaN values are ignored. If the image contains no valid values, `count`
+   * is zero and all other members are NaN. The variance is that of the
+   * population (i.e. normalised by `count`).
+   */
+  struct ImageStatistics {
+    std::size_t count;
+    double min, max, mean, variance;
+  };
 
-    for (int y = 0; y < input_image.height(); ++y) {
-      for (int x = 0; x < input_image.width(); ++x) {
-        SourceType pixel = input_image(x, y);
-        if (pixel < min_val) min_val = pixel;
-        if (pixel > max_val) max_val = pixel;
-      }
-    }
+  //! Compute the minimum, maximum, mean & variance of an image in a single pass
+  template <typename T>
+    ImageStatistics compute_statistics (const Image<T>& image);
+
+  //! Rounding modes for conversion to integer pixel types
+  enum class Rounding {
+    NEAREST,      //!< to nearest, with halfway cases rounded away from zero
+    TOWARD_ZERO,  //!< truncate
+    DOWN,         //!< towards negative infinity
+    UP            //!< towards positive infinity
+  };
 
-    constexpr TargetType targetMin = std::numeric_limits<TargetType>::min();
-    constexpr TargetType targetMax = std::numeric_limits<TargetType>::max();
-    const double sourceRange = static_cast<double>(max_val) - min_val;
-    const double targetRange = static_cast<double>(targetMax) - targetMin;
+  //! Convert an image to a different pixel type
+  /**
+   * Each value is mapped to `value * scale + offset`. For integer target
+   * types, the result is then rounded as specified by `rounding`, and
+   * saturated to the range of the target type, with NaN mapped to zero.
+   * Values are converted as-is for floating-point target types.
+   *
+   * Supported pixel types are 8, 16 & 32-bit integers, float & double.
+   */
+  template <typename TargetType, typename SourceType>
+    Image<TargetType> convert (const Image<SourceType>& image, double scale = 1.0, double offset = 0.0,
+        Rounding rounding = Rounding::NEAREST);
 
-    TG::Image<TargetType> output(input_image.width(), input_image.height());
+  //! Convert an image to a different pixel type, mapping its intensity range onto [ min max ]
+  /**
+   * The smallest value in the image maps to `min`, and the largest to
+   * `max`, rounding to the nearest integer for integer target types.
+   */
+  template <typename TargetType, typename SourceType>
+    Image<TargetType> rescale (const Image<SourceType>& image, double min, double max);
 
-    for (int y = 0; y < input_image.height(); ++y) {
-      for (int x = 0; x < input_image.width(); ++x) {
-        auto targetValue = std::round((input_image(x, y) - min_val) * (targetRange / sourceRange) + targetMin);
-        output(x, y) = static_cast<TargetType>(targetValue);
-      }
-    }
-    return output;
-  }
+  //! Convert an image to a different pixel type, mapping its intensity range onto that of the target type
+  /**
+   * The target range is the full range of integer target types, and [ 0 1 ]
+   * for floating-point types.
+   */
+  template <typename TargetType, typename SourceType>
+    Image<TargetType> rescale (const Image<SourceType>& image);
+
+  //! \deprecated use rescale<TargetType>() instead
+  template <typename SourceType, typename TargetType>
+    [[deprecated ("use TG::rescale<TargetType>() instead")]]
+    Image<TargetType> convert_image_to_unsigned_short (const Image<SourceType>& input_image);
 
 
 
@@ -305,175 +507,263 @@ namespace TG {
         const ANGLE _angle;
   };
 
+  //! Compute the histogram of an image, using `bin_count` bins over the range [min, max)
+  /**
+   * Bin `n` counts the values in the interval [ min + n*w, min + (n+1)*w ),
+   * where `w = (max-min)/bin_count`. Values outside the range are counted
+   * in the first or last bin (as are NaN values, in the first bin).
+   *
+   * For 8 & 16-bit integer types, values are first counted at full
+   * resolution (one entry per possible value) and then folded into the
+   * requested bins, so that the cost is independent of the binning.
+   *
+   * The computation is split over multiple threads for large images, each
+   * accumulating its own private histograms (4 interleaved sub-histograms per
+   * thread, to avoid successive increments of the same bin stalling on each
+   * other), which are merged at the end.
+   */
+  template <typename T>
+    std::vector<int> compute_histogram (const Image<T>& image, int bin_count, double min, double max);
+
+  //! Compute the histogram of an image, using the default binning for type `T`
+  /**
+   * - `bool`: 2 bins
+   * - 8 & 16-bit integer types: one bin per possible value
+   * - floating-point types: 256 bins, with values in [0,1] rounded to the
+   *   nearest bin
+   *
+   * Other types (e.g. 32-bit integers) require the bins to be specified
+   * explicitly.
+   */
+  template <typename T>
+    std::vector<int> compute_histogram (const Image<T>& image);
+
+  //! Contrast-limited adaptive histogram equalisation (CLAHE)
+  /**
+   * The image is divided into `tiles_x` x `tiles_y` tiles, and the
+   * histogram of each tile (using `bin_count` bins over the intensity range
+   * of the image) is clipped at `clip_limit` times its mean bin count, with
+   * the excess redistributed evenly across all bins. The cumulative
+   * histograms then provide a lookup table per tile, mapping intensities
+   * back onto the range of the image. Each pixel is mapped by bilinear
+   * interpolation between the lookup tables of the 4 nearest tiles.
+   *
+   * Higher values of `clip_limit` give stronger contrast enhancement (and
+   * noise amplification); a value <= 0 disables clipping, giving plain
+   * adaptive histogram equalisation.
+   */
+  template <typename T>
+    Image<T> clahe (const Image<T>& image, double clip_limit = 2.0, int tiles_x = 8, int tiles_y = 8, int bin_count = 256);
+
    /**
    * Function to calculate histogram for any numeric data type
    */
   template <typename T>
   auto histogramize = [](const TG::Image<T>& image) {
-    constexpr auto bin_count = []() -> auto {
-      if constexpr (std::is_floating_point_v<T>) {
-        return static_cast<T>(256);
-      } else if constexpr (std::is_same_v<T, bool>) {
-        return static_cast<T>(2);
-      } else if constexpr (std::is_integral_v<T>) {
-        return std::numeric_limits<T>::max() - std::numeric_limits<T>::min() + 1;
-      } else {
-        static_assert(std::is_arithmetic_v<T>, "Unsupported data type for histogram.");
-        return T{};
-      }
-    }();
-
-    std::vector<int> histogram(bin_count, 0);
-
-    for (int y = 0; y < image.height(); ++y) {
-      for (int x = 0; x < image.width(); ++x) {
-        T pixel_value = image(x, y);
-        if constexpr (std::is_floating_point_v<T>) {
-          int index = static_cast<int>(std::round(pixel_value * (bin_count - 1)));
-          index = std::clamp(index, 0, bin_count - 1);
-          histogram[index]++;
-        } else {
-          if (pixel_value >= std::numeric_limits<T>::min() && pixel_value <= std::numeric_limits<T>::max()) {
-            histogram[static_cast<int>(pixel_value) - std::numeric_limits<T>::min()]++;
-          }
-        }
-      }
-    }
-    return histogram;
+    return compute_histogram (image);
   };
 
-  // Get histogram data
+  // Get histogram data, omitting the first & last bins
   template <typename T>
-  std::vector<int> get_histogram_data(const TG::Image<T>& image) {
-    auto histogram = histogramize<T>(image);
-    auto bin_count = histogram.size();
-
-    if (bin_count > 2) {
-      return std::vector<int>(histogram.begin() + 1, histogram.end() - 1);
-    }
-    return histogram;
-  }
+  std::vector<int> get_histogram_data(const TG::Image<T>& image);
 
     /**
   * Compute threshold based on a given histogram.
   */
   template <typename T>
-  int compute_otsu_threshold(const std::vector<int>& histogram, int total) {
-    std::vector<double> prob(histogram.size(), 0.0);
-    for (size_t i = 0; i < histogram.size(); ++i) {
-      prob[i] = static_cast<double>(histogram[i]) / total;
-    }
+  int compute_otsu_threshold(const std::vector<int>& histogram, int total);
 
-    double sum = 0.0;
-    for (size_t i = 0; i < histogram.size(); ++i) {
-      sum += i * prob[i];
-    }
+  //! Compute the thresholds splitting a histogram into `classes` classes using multi-level Otsu
+  /**
+   * This finds the set of `classes-1` thresholds maximising the
+   * between-class variance. Each threshold is the last bin of the class
+   * below it (as for compute_otsu_threshold()), so that class `n` contains
+   * the bins above `thresholds[n-1]` up to & including `thresholds[n]`.
+   *
+   * The histogram is typically the output of histogramize() or
+   * compute_histogram(); for the default binning of unsigned 8 & 16-bit
+   * types, the bins correspond directly to the intensities.
+   *
+   * The optimal thresholds are found by dynamic programming over the
+   * cumulative count & moment tables of the histogram, at a cost of
+   * O(L^2) per class for L non-empty bins. For 16-bit data, it is best to
+   * compute the histogram with fewer bins (e.g. 256) first.
+   *
+   * Fewer thresholds will be returned if the histogram has fewer non-empty
+   * bins than the number of classes requested.
+   */
+  std::vector<int> compute_multi_otsu_thresholds (const std::vector<int>& histogram, int classes = 3);
 
-    double sumB = 0.0, wB = 0.0, wF = 0.0;
-    double max_variance = 0.0;
-    int threshold = 0;
+  //! Assign each pixel the index of its class, as delimited by the thresholds supplied
+  /**
+   * Pixels with intensities <= `thresholds[0]` are assigned to class 0,
+   * those above `thresholds[0]` and <= `thresholds[1]` to class 1, etc.
+   * The thresholds must be sorted in increasing order (as returned by
+   * compute_multi_otsu_thresholds()).
+   */
+  template <typename T>
+    Image<unsigned char> apply_thresholds (const Image<T>& image, const std::vector<int>& thresholds);
 
-    for (size_t t = 0; t < histogram.size(); ++t) {
-      wB += prob[t];
-      if (wB == 0) continue;
-      wF = 1.0 - wB;
-      if (wF == 0) break;
+  /**
+  * Apply adaptive thresholding using block-wise Otsu thresholds
+  *
+  * Each pixel is compared to the Otsu threshold computed over the
+  * `block_size` x `block_size` window centred on it (clipped to the image
+  * bounds), using a 256-bin histogram of the raw intensities. The local
+  * histogram is updated incrementally as the window slides along each row
+  * (adding one column and removing another), and rows are processed in
+  * parallel bands for large images.
+  */
+  template <typename T>
+  TG::Image<unsigned char> adaptive_threshold_blockwise(const TG::Image<T>& image, int block_size);
 
-      sumB += t * prob[t];
-      double meanB = sumB / wB;
-      double meanF = (sum - sumB) / wF;
 
-      double varBetween = wB * wF * std::pow(meanB - meanF, 2);
-      if (varBetween > max_variance) {
-        max_variance = varBetween;
-        threshold = t;
-      }
-    }
+  //! Summed-area tables of the intensities of an image, and of their squares
+  /**
+   * An integral image holds, for each location, the sum of all intensities
+   * above and to the left of it. Once computed (in a single pass over the
+   * image), this allows the sum, mean or variance of the intensities over
+   * any rectangle to be obtained in constant time, regardless of its size.
+   *
+   * The accumulators are chosen to avoid overflow: 64-bit integers for
+   * integer types up to 16 bits (sufficient for well over 2^32 pixels),
+   * and double precision otherwise.
+   *
+   * Rectangles are specified as half-open ranges [x0,x1) x [y0,y1), and are
+   * clipped to the image bounds.
+   */
+  template <typename T>
+    class IntegralImage {
+      public:
+        using sum_type = std::conditional_t<std::is_integral_v<T> && sizeof(T) <= 2,
+              std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>, double>;
+        using square_sum_type = std::conditional_t<std::is_integral_v<T> && sizeof(T) <= 2,
+              unsigned long long, double>;
 
-    return threshold;
-  }
+        IntegralImage (const Image<T>& image);
 
-  /**
-  * Apply adaptive thresholding using block-wise 
-  */
+        int width () const;
+        int height () const;
+
+        //! number of pixels within the rectangle
+        long long count (int x0, int y0, int x1, int y1) const;
+        //! sum of intensities within the rectangle
+        sum_type sum (int x0, int y0, int x1, int y1) const;
+        //! sum of squared intensities within the rectangle
+        square_sum_type sum_of_squares (int x0, int y0, int x1, int y1) const;
+        //! mean intensity within the rectangle
+        double mean (int x0, int y0, int x1, int y1) const;
+        //! variance of the intensities within the rectangle
+        double variance (int x0, int y0, int x1, int y1) const;
+
+      private:
+        const int x_dim, y_dim;
+        std::vector<sum_type> sums;
+        std::vector<square_sum_type> square_sums;
+
+        template <typename ValueType>
+          ValueType lookup (const std::vector<ValueType>& table, int x0, int y0, int x1, int y1) const;
+        void clip (int& x0, int& y0, int& x1, int& y1) const;
+    };
+
+  //! Local mean over the `block_size` x `block_size` window centred on each pixel
+  /** The window is clipped to the image bounds. This uses an
+   * IntegralImage, so that the cost is independent of the window size. */
   template <typename T>
-  TG::Image<unsigned char> adaptive_threshold_blockwise(const TG::Image<T>& image, int block_size) {
-    TG::Image<unsigned char> binary_image(image.width(), image.height());
+    Image<float> box_mean (const Image<T>& image, int block_size);
 
-    int half_block = block_size / 2;
-    for (int y = 0; y < image.height(); ++y) {
-      for (int x = 0; x < image.width(); ++x) {
-        int x1 = std::max(x - half_block, 0);
-        int y1 = std::max(y - half_block, 0);
-        int x2 = std::min(x + half_block, image.width() - 1);
-        int y2 = std::min(y + half_block, image.height() - 1);
+  //! Local variance over the `block_size` x `block_size` window centred on each pixel
+  /** \sa box_mean() */
+  template <typename T>
+    Image<float> box_variance (const Image<T>& image, int block_size);
 
-        std::vector<int> local_hist(256, 0);
-        int count = 0;
-        for (int j = y1; j <= y2; ++j) {
-          for (int i = x1; i <= x2; ++i) {
-            local_hist[image(i, j)]++;
-            count++;
-          }
-        }
+  //! Box (moving average) filter, with cost independent of the window size
+  /** \sa box_mean() */
+  template <typename T>
+    Image<T> box_blur (const Image<T>& image, int block_size);
+
+  //! Niblack adaptive thresholding
+  /**
+   * Pixels are set to 255 where the intensity exceeds `m + k*s`, where `m`
+   * & `s` are the mean & standard deviation of the intensities within the
+   * `block_size` x `block_size` window centred on each pixel (clipped to the
+   * image bounds), and 0 elsewhere.
+   *
+   * This relies on an IntegralImage, so that the cost is independent of the
+   * window size, and provides a fast alternative to
+   * adaptive_threshold_blockwise().
+   */
+  template <typename T>
+    Image<unsigned char> threshold_niblack (const Image<T>& image, int block_size, double k = -0.2);
 
-        int local_threshold = compute_otsu_threshold<T>(local_hist, count);
+  //! Sauvola adaptive thresholding
+  /**
+   * As for threshold_niblack(), but using the threshold `m * (1 + k*(s/R - 1))`,
+   * where `R` is the dynamic range of the standard deviation (128 by
+   * default, appropriate for 8-bit images).
+   */
+  template <typename T>
+    Image<unsigned char> threshold_sauvola (const Image<T>& image, int block_size, double k = 0.2, double R = 128.0);
 
-        binary_image(x, y) = (image(x, y) > local_threshold) ? 255 : 0;
-      }
-    }
-    return binary_image;
-  }
+  //! How apply_gaussian_filter() should perform the smoothing
+  enum class GaussianMode {
+    AUTO,       // Choose based on kernel size & sigma
+    SEPARABLE,  // Two 1-D passes with the truncated kernel
+    RECURSIVE   // Recursive (IIR) approximation, cost independent of sigma
+  };
 
   /**
  * Applies a Gaussian filter to an image.
  * The filter smooths the image using a Gaussian kernel of a given size and sigma.
+ *
+ * The filter is applied as two 1-D passes (along rows, then columns), with
+ * image edges replicated as required. The 1-D kernels are cached, so that
+ * repeated calls with the same parameters do not recompute them.
+ *
+ * For large kernels that are not significantly truncated (`kernel_size` at
+ * least 5 times `sigma`), with `sigma` of at least 3 (where the recursive
+ * approximation is accurate), the default GaussianMode::AUTO mode uses the
+ * recursive approximation instead (see apply_recursive_gaussian_filter()),
+ * whose cost does not depend on the kernel size.
  */
   template <typename T>
-  TG::Image<T> apply_gaussian_filter(const TG::Image<T>& image, int kernel_size, double sigma) {
-    if (kernel_size % 2 == 0) {
-      throw std::invalid_argument("Kernel size must be odd.");
-    }
-
-    int half_size = kernel_size / 2;
-    std::vector<std::vector<double>> kernel(kernel_size, std::vector<double>(kernel_size));
-    double sum = 0.0;
-
-    // kernel
-    for (int y = -half_size; y <= half_size; ++y) {
-      for (int x = -half_size; x <= half_size; ++x) {
-        kernel[y + half_size][x + half_size] = 
-        std::exp(-(x * x + y * y) / (2 * sigma * sigma)) / (2 * M_PI * sigma * sigma);
-        sum += kernel[y + half_size][x + half_size];
-      }
-    }
+  TG::Image<T> apply_gaussian_filter(const TG::Image<T>& image, int kernel_size, double sigma,
+      GaussianMode mode = GaussianMode::AUTO);
 
-    // normalize
-    for (auto& row : kernel) {
-      for (double& val : row) {
-        val /= sum;
-      }
-    }
-
-    TG::Image<T> filtered_image(image.width(), image.height());
-
-    // convolution
-    for (int y = 0; y < image.height(); ++y) {
-      for (int x = 0; x < image.width(); ++x) {
-        double new_value = 0.0;
-        for (int ky = -half_size; ky <= half_size; ++ky) {
-          for (int kx = -half_size; kx <= half_size; ++kx) {
-            int img_x = std::clamp(x + kx, 0, image.width() - 1);
-            int img_y = std::clamp(y + ky, 0, image.height() - 1);
-            new_value += image(img_x, img_y) * kernel[ky + half_size][kx + half_size];
-          }
-        }
-        filtered_image(x, y) = static_cast<T>(std::round(new_value));
-      }
-    }
+  //! Applies a recursive (IIR) approximation to Gaussian smoothing
+  /**
+   * This uses the Young & van Vliet (1995) third-order recursive filter,
+   * run forwards & backwards along rows & columns. The cost per pixel is
+   * constant, regardless of `sigma`, which must be at least 0.5. Image edges
+   * are treated as replicated.
+   */
+  template <typename T>
+    Image<T> apply_recursive_gaussian_filter (const Image<T>& image, double sigma);
 
-    return filtered_image;
-  }
+  //! Edge-preserving bilateral filter
+  /**
+   * Each pixel is replaced by an average of its neighbours, weighted both by
+   * their distance (Gaussian, with standard deviation `sigma_spatial`
+   * pixels) and by their difference in intensity (Gaussian, with standard
+   * deviation `sigma_range` in the units of the image intensities), so that
+   * smoothing does not extend across strong edges.
+   *
+   * This uses the bilateral grid approximation (Chen, Paris & Durand,
+   * 2007): pixels are accumulated into a 3-D grid downsampled by the sigmas
+   * along x, y & intensity, the grid is blurred, and the result sampled
+   * back at each pixel by trilinear interpolation. The cost is roughly
+   * linear in the number of pixels, and decreases as the sigmas increase.
+   *
+   * Only the intensity axis of the grid is bounded: it is sampled more
+   * coarsely where needed to keep the grid to 2^22 cells (64 MB of working
+   * memory), so that the filter then behaves as if `sigma_range` were
+   * larger (about 1/130 of the intensity range for a 512x512 image with
+   * `sigma_spatial` of 3). The intensity axis always keeps at least 8
+   * cells, so the grid can exceed this budget for large images with a
+   * small `sigma_spatial`, which sets the number of cells along x & y.
+   */
+  template <typename T>
+    Image<T> bilateral_filter (const Image<T>& image, double sigma_spatial, double sigma_range);
 
 
   enum class PaddingType {
@@ -483,221 +773,590 @@ namespace TG {
     CIRCULAR    // Wrap around the image
   };
 
+  //! A square convolution kernel, with weights stored contiguously in row-major order
   /**
-  * Applies convolution to an image using a specified kernel and padding type.
-  */
-  template <typename T>
-  TG::Image<T> convolve(const TG::Image<T>& input, const std::vector<std::vector<float>>& kernel, PaddingType padding_type = PaddingType::ZERO) {
-    int kernel_size = kernel.size();
-    if (kernel_size % 2 == 0) {
-      throw std::invalid_argument("Kernel size must be odd.");
-    }
-
-    int pad = kernel_size / 2;
-    int width = input.width();
-    int height = input.height();
+   * The kernel size must be odd. It can be initialised from a nested list of
+   * rows, for example:
+   *
+   *     const TG::Kernel sobel_x = {
+   *       { -1, 0, 1 },
+   *       { -2, 0, 2 },
+   *       { -1, 0, 1 }
+   *     };
+   */
+  class Kernel {
+    public:
+      //! instantiate a kernel of the specified size, with all weights set to zero
+      explicit Kernel (int size);
+      //! instantiate a kernel from its rows of weights (implicitly, so these can be passed directly to convolve())
+      Kernel (const std::vector<std::vector<float>>& weights);
+      Kernel (std::initializer_list<std::initializer_list<float>> weights);
 
-    TG::Image<T> output(width, height);
+      int size () const;
 
-    auto get_padded_pixel = [&](int x, int y) -> T {
-      if (x >= 0 && x < width && y >= 0 && y < height) {
-        return input(x, y);  
-      }
+      //! query or set weight at offset (x,y) from the top-left corner
+      float& operator() (int x, int y);
+      float operator() (int x, int y) const;
 
-      switch (padding_type) {
-        case PaddingType::ZERO:
-          return 0;  
-        case PaddingType::REPLICATE:
-          x = std::clamp(x, 0, width - 1);
-          y = std::clamp(y, 0, height - 1);
-          return input(x, y); 
-        case PaddingType::REFLECT:
-          x = std::abs(x) % (2 * width);
-          y = std::abs(y) % (2 * height);
-          if (x >= width) x = 2 * width - 1 - x;
-          if (y >= height) y = 2 * height - 1 - y;
-          return input(x, y); 
-        case PaddingType::CIRCULAR:
-          x = (x + width) % width;
-          y = (y + height) % height;
-          return input(x, y); 
-        default:
-          throw std::invalid_argument("Invalid padding type.");
-      }
-    };
+      const float* data () const;
 
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-        float sum = 0.0f;
-        for (int ky = -pad; ky <= pad; ++ky) {
-          for (int kx = -pad; kx <= pad; ++kx) {
-            int img_x = x + kx;
-            int img_y = y + ky;
-            T pixel_value = get_padded_pixel(img_x, img_y);
-            sum += pixel_value * kernel[ky + pad][kx + pad];
-          }
-        }
-        output(x, y) = static_cast<T>(std::round(sum));
-      }
-    }
+    private:
+      int dim;
+      std::vector<float> weights;
+  };
 
-    return output;
-  }
+  //! How convolve() should compute the result
+  enum class ConvolutionMethod {
+    AUTO,       // Choose based on kernel size & structure
+    DIRECT,     // Direct summation over the kernel
+    FFT,        // Fourier-domain multiplication, for large kernels
+    SEPARABLE   // Sum of 1-D passes along rows & columns
+  };
 
   /**
-  * apply run lengh encod algorithm to he image.
+  * Applies convolution to an image using a specified kernel and padding type.
+  *
+  * As for most image processing packages, this computes the correlation of
+  * the image with the kernel (i.e. the kernel is not flipped). The result is
+  * rounded to the nearest integer & saturated to the range of the pixel type
+  * where necessary.
+  *
+  * With ConvolutionMethod::DIRECT, the image is padded once per band of
+  * rows, so that the inner loops are free of bounds checks and vectorise
+  * readily. Kernels of size 3, 5 & 7 use fully unrolled, compile-time
+  * specialisations.
+  *
+  * With ConvolutionMethod::FFT, the image is processed in tiles, each
+  * convolved by multiplication in the Fourier domain (overlap-save), with
+  * two tiles handled per complex transform. Transform plans & kernel spectra
+  * are cached for subsequent calls. All padding types are supported.
+  *
+  * With ConvolutionMethod::SEPARABLE, the kernel is factorised into a sum
+  * of outer products of 1-D vertical & horizontal kernels, each applied as
+  * two 1-D passes. Rank-1 kernels (such as Sobel, box & Gaussian kernels)
+  * require a single pair of passes, reducing the work per pixel from K^2
+  * to 2K. Exactly separable kernels are factorised directly from their
+  * rows & columns, which is exact for integer weights; other kernels are
+  * approximated via their singular value decomposition, keeping as many
+  * terms as needed to reproduce the kernel to a relative (Frobenius norm)
+  * error of 1e-6.
+  *
+  * The default ConvolutionMethod::AUTO uses the separable approach for
+  * low rank kernels larger than 7x7, and otherwise the FFT for kernels of size 15
+  * and above.
   */
   template <typename T>
-  std::vector<std::pair<T, int>> run_length_encode(const TG::Image<T>& image) {
-    std::vector<std::pair<T, int>> encoded;
-    int width = image.width();
-    int height = image.height();
-        
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-        T pixel = image(x, y);
-        if (!encoded.empty() && encoded.back().first == pixel) {
-          encoded.back().second++;
-        } else {
-          encoded.emplace_back(pixel, 1);
-        }
-      }
-    }
-    return encoded;
-  }
+  TG::Image<T> convolve(const TG::Image<T>& input, const Kernel& kernel, PaddingType padding_type = PaddingType::ZERO,
+      ConvolutionMethod method = ConvolutionMethod::AUTO);
+
 
+  //! Median filter over the `size` x `size` neighbourhood of each pixel
   /**
-  * save the encoded file
-  */
+   * This is restricted to 8 & 16-bit integer images, and uses Huang's
+   * sliding histogram: as the window moves along each row, one column is
+   * added to the histogram & another removed, and the median is tracked
+   * incrementally from its previous position, using a two-level histogram
+   * to skip over runs of empty bins. The cost per pixel is therefore
+   * proportional to `size` rather than `size^2`. For 8-bit images with
+   * `size` >= 7, the constant-time variant of Perreault & Hebert is used
+   * instead, maintaining a histogram per column so that the cost per pixel
+   * is independent of `size`. The common 3x3 case uses a sorting network.
+   * Rows are processed in parallel bands. `size` must be odd.
+   */
   template <typename T>
-  void save_encoded_to_file(const std::vector<std::pair<T, int>>& encoded, const std::string& filename) {
-    std::ofstream outFile(filename, std::ios::binary);
-    if (!outFile) {
-      throw std::runtime_error("Failed to open file for writing");
-    }
-    for (const auto& pair : encoded) {
-      outFile.write(reinterpret_cast<const char*>(&pair.first), sizeof(T));
-      outFile.write(reinterpret_cast<const char*>(&pair.second), sizeof(int));
-    }
-    outFile.close();
-  }
+    Image<T> median_filter (const Image<T>& image, int size, PaddingType padding_type = PaddingType::REPLICATE);
 
+  //! Greyscale erosion (local minimum) over a square `size` x `size` structuring element
   /**
-  * load the encoded file
-  */
+   * Morphological operations are computed using the van Herk/Gil-Werman
+   * algorithm, as a horizontal then vertical pass, so that the cost per
+   * pixel is independent of `size` (3 comparisons per pass). These apply
+   * equally to binary masks, such as the output of
+   * adaptive_threshold_blockwise().
+   *
+   * With the default PaddingType::REPLICATE, the structuring element is
+   * effectively clipped to the image bounds. `size` must be odd.
+   */
   template <typename T>
-  std::vector<std::pair<T, int>> load_encoded_from_file(const std::string& filename) {
-    std::ifstream inFile(filename, std::ios::binary);
-    if (!inFile) {
-      throw std::runtime_error("Failed to open file for reading");
-    }
-    std::vector<std::pair<T, int>> encoded;
-    T pixel;
-    int count;
-    while (inFile.read(reinterpret_cast<char*>(&pixel), sizeof(T))) {
-      inFile.read(reinterpret_cast<char*>(&count), sizeof(int));
-      encoded.emplace_back(pixel, count);
-    }
-    inFile.close();
-    return encoded;
-  }
+    Image<T> erode (const Image<T>& image, int size, PaddingType padding_type = PaddingType::REPLICATE);
 
-  /**
-  * decode the binary image back
-  */
+  //! Greyscale dilation (local maximum) over a square `size` x `size` structuring element
+  /** \sa erode() */
   template <typename T>
-  TG::Image<T> run_length_decode(const std::vector<std::pair<T, int>>& encoded, int width, int height) {
-    TG::Image<T> image(width, height);
-    int x = 0, y = 0;
-    for (const auto& pair : encoded) {
-      for (int i = 0; i < pair.second; ++i) {
-        if (x >= width) {
-          x = 0;
-          y++;
-        }
-        if (y >= height) break;
-        image(x, y) = pair.first;
-        x++;
-      }
-    }
-    return image;
-  }
+    Image<T> dilate (const Image<T>& image, int size, PaddingType padding_type = PaddingType::REPLICATE);
 
-  /**
-  * convert cartesian to polar and then apply gaussian 
-  */
+  //! Morphological opening: erosion followed by dilation
+  /** This removes bright features smaller than the structuring element.
+   * \sa erode() */
   template <typename T>
-  TG::Image<T> cartesian_to_polar(const TG::Image<T>& image) {
-    int width = image.width();
-    int height = image.height();
-    int radius = std::min(width, height) / 2;
-    TG::Image<T> polar_image(radius, 360);
-    
-    int cx = width / 2;
-    int cy = height / 2;
-    
-    for (int r = 0; r < radius; ++r) {
-      for (int theta = 0; theta < 360; ++theta) {
-        double radian = theta * M_PI / 180.0;
-        int x = cx + static_cast<int>(r * cos(radian));
-        int y = cy + static_cast<int>(r * sin(radian));
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-          polar_image(r, theta) = image(x, y);
-        }
-      }
-    }
-    return apply_gaussian_filter(polar_image, 5, 1.0); // Applying Gaussian filter in polar domain
-  }
+    Image<T> opening (const Image<T>& image, int size, PaddingType padding_type = PaddingType::REPLICATE);
 
-  /**
-  * convert the polar system back to cartesian system.
-  */
+  //! Morphological closing: dilation followed by erosion
+  /** This fills dark gaps smaller than the structuring element.
+   * \sa erode() */
   template <typename T>
-  TG::Image<T> polar_to_cartesian(const TG::Image<T>& polar_image, int width, int height) {
-    TG::Image<T> cartesian_image(width, height);
-    int cx = width / 2;
-    int cy = height / 2;
-    int radius = polar_image.width();
-    
-    for (int r = 0; r < radius; ++r) {
-      for (int theta = 0; theta < 360; ++theta) {
-        double radian = theta * M_PI / 180.0;
-        int x = cx + static_cast<int>(r * cos(radian));
-        int y = cy + static_cast<int>(r * sin(radian));
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-          cartesian_image(x, y) = polar_image(r, theta);
-        }
-      }
-    }
-    return cartesian_image;
-  }
+    Image<T> closing (const Image<T>& image, int size, PaddingType padding_type = PaddingType::REPLICATE);
 
-  //! Adapter class to magnify an image
+  //! Exact Euclidean distance transform of a binary image
   /**
-   * This makes the image `factor` bigger than the original.
-   */
-  template <class ImageType>
-    class magnify {
-      public:
-        magnify (const ImageType& image, int factor);
-
-        int width () const;
-        int height () const;
-        decltype(std::declval<const ImageType>()(0,0)) operator() (int x, int y) const;
+   * Each non-zero pixel is set to its distance from the nearest zero pixel,
+   * and zero pixels are set to zero. Pixels are infinitely far away if the
+   * image contains no zero pixels.
+   *
+   * This uses the lower envelope algorithm of Felzenszwalb & Huttenlocher
+   * (2012), in linear time: distances along each column are computed first
+   * (in parallel strips of columns), then each row is processed as the
+   * lower envelope of the parabolas rooted at each pixel (in parallel bands
+   * of rows).
+   * \sa squared_distance_transform() */
+  template <typename T>
+    Image<float> distance_transform (const Image<T>& mask);
 
-      private:
-        const ImageType& im;
-        const int factor;
-    };
+  //! Exact squared Euclidean distance transform of a binary image
+  /** As for distance_transform(), but returning the squared distances as
+   * exact integers, with pixels infinitely far away set to the maximum
+   * value of the type. */
+  template <typename T>
+    Image<unsigned int> squared_distance_transform (const Image<T>& mask);
 
 
+  //! Operators available to compute image gradients
+  enum class GradientOperator {
+    SOBEL,   // [1 2 1] smoothing across the derivative
+    SCHARR   // [3 10 3] smoothing, for better rotational symmetry
+  };
 
+  //! Gradient magnitude & orientation of an image
+  /**
+   * The orientation is given in radians, as `atan2 (gy, gx)` where `gx` &
+   * `gy` are the derivatives along x (increasing to the right) & y
+   * (increasing downwards).
+   */
+  struct Gradient {
+    Image<float> magnitude, orientation;
+  };
 
+  //! Compute the gradient of an image in a single pass
+  /**
+   * Both derivatives are computed together from a ring buffer of 3 padded
+   * rows, with integer images accumulated as `int` so that negative &
+   * large responses are preserved, rather than truncated into the pixel
+   * type as would be the case for convolve(). The orientation image is
+   * left empty if `with_orientation` is false.
+   */
+  template <typename T>
+    Gradient compute_gradient (const Image<T>& image, GradientOperator op = GradientOperator::SOBEL,
+        PaddingType padding_type = PaddingType::REPLICATE, bool with_orientation = true);
 
-  //! Display an indexed image to the terminal, according to the colourmap supplied.
+  //! Canny edge detection
   /**
-   * ImageType can be any object that implements the following methods:
-   * - `int width() const`
+   * The image is smoothed with a Gaussian of standard deviation `sigma`
+   * (skipped if `sigma` is zero), its gradient computed using the
+   * operator specified, and edges thinned to local maxima along the
+   * gradient direction. Pixels whose gradient magnitude exceeds
+   * `high_threshold` are then marked as edges, along with those exceeding
+   * `low_threshold` that are connected (8-neighbour) to them.
+   *
+   * The smoothing, gradient & non-maximum suppression stages are streamed
+   * through small ring buffers of rows, in parallel bands, so that none of
+   * the intermediate images are held in full. The returned image holds 255
+   * for edges, 0 elsewhere.
+   */
+  template <typename T>
+    Image<unsigned char> canny (const Image<T>& image, double low_threshold, double high_threshold,
+        double sigma = 1.4, GradientOperator op = GradientOperator::SOBEL);
+
+  //! Statistics of a connected component, as returned by connected_components()
+  struct Component {
+    std::size_t area;                   // number of pixels
+    int x_min, y_min, x_max, y_max;     // bounding box, inclusive
+    double centroid_x, centroid_y;
+  };
+
+  //! Label image & component statistics, as returned by connected_components()
+  struct Components {
+    Image<int> labels;                  // 0 for background, n+1 for components[n]
+    std::vector<Component> components;
+  };
+
+  //! Label the connected components of the non-zero pixels of an image
+  /**
+   * Pixels are connected to their 4 direct neighbours if `connectivity` is
+   * 4, or to their 8 neighbours including diagonals if it is 8.
+   *
+   * The image is scanned into runs of non-zero pixels, which are then joined
+   * with the runs they touch on the previous row using union-find, in
+   * parallel bands of rows, before joining runs across the band boundaries.
+   * The label image and per-component statistics are then produced directly
+   * from the runs. Components are numbered from 1 in the order in which
+   * they are first encountered in a raster scan, irrespective of the number
+   * of threads used.
+   *
+   * Images that provide their runs (see HasRowRuns), such as RLEImage, are
+   * labelled directly from their runs.
+   *
+   * Use wrap_labels() & label_colours() to display the label image, e.g.:
+   *
+   *     auto result = TG::connected_components (mask);
+   *     TG::imshow (TG::wrap_labels (result.labels), TG::label_colours());
+   */
+  template <class ImageType>
+    Components connected_components (const ImageType& mask, int connectivity = 8);
+
+  //! Run-length encode an image
+  /**
+   * Returns (value, count) pairs for successive runs of identical pixels,
+   * in row-major order - runs may continue from one row onto the next.
+   *
+   * Runs are located by comparing 32 bytes at a time for integer pixel
+   * types, and bands of the image are encoded in parallel, so that images
+   * consisting mostly of long runs (such as masks) encode at close to
+   * memory bandwidth.
+   */
+  template <typename T>
+    std::vector<std::pair<T, int>> run_length_encode (const Image<T>& image);
+
+  //! Save run-length encoded image to file
+  /**
+   * The file is written in a single block, in version 1 of the RLE file
+   * format, which records the image dimensions & pixel type alongside the
+   * runs:
+   *
+   * - a 16-byte header: the magic number "TGRL", the version number (1
+   *   byte), the pixel type (1 byte: kind in the high nibble - 0 for
+   *   unsigned, 1 for signed, 2 for floating-point - & size in bytes in the
+   *   low nibble), 2 reserved bytes, then the width & height as 32-bit
+   *   integers;
+   * - the row index: the size in bytes of the runs of each row;
+   * - the runs of each row in turn: the pixel value, followed by the run
+   *   length minus one. Runs never extend past the end of a row.
+   *
+   * All values are little-endian, with the row index & run lengths stored
+   * as LEB128 variable-length integers, so that runs of up to 128 pixels
+   * take a single byte.
+   *
+   * The runs must cover the `width` x `height` image exactly.
+   */
+  template <typename T>
+    void save_encoded_to_file (const std::vector<std::pair<T, int>>& encoded, int width, int height, const std::string& filename);
+
+  //! Save run-length encoded image to file in the legacy format
+  /**
+   * This writes the raw (pixel, int) pairs with no header, so the file
+   * cannot be read back without knowing the image dimensions & pixel type.
+   */
+  template <typename T>
+    [[deprecated ("use save_encoded_to_file (encoded, width, height, filename) instead")]]
+    void save_encoded_to_file (const std::vector<std::pair<T, int>>& encoded, const std::string& filename);
+
+  //! Load run-length encoded image from file
+  /**
+   * This reads both the versioned RLE file format & the legacy headerless
+   * format, detected from the magic number. For versioned files, the pixel
+   * type must match `T`, & runs never span rows.
+   */
+  template <typename T>
+    std::vector<std::pair<T, int>> load_encoded_from_file (const std::string& filename);
+
+  //! Load and decode an image from a file in the versioned RLE format
+  /**
+   * The dimensions are read from the file, and the pixel type must match
+   * `T` - use read_rle_file_info() to find out what it is.
+   */
+  template <typename T>
+    Image<T> load_rle (const std::string& filename);
+
+  //! Information stored in the header of an RLE file
+  struct RLEFileInfo {
+    int version;
+    int width, height;
+    std::string pixel_type;  //!< e.g. "uint8", "int16", "float32"
+  };
+
+  //! Read the header of an RLE file
+  RLEFileInfo read_rle_file_info (const std::string& filename);
+
+  //! Run-length encoded image, with random access to its rows
+  /**
+   * This holds the runs of each row separately, along with an index to the
+   * first run of each row, so that rows can be accessed without decoding
+   * the image. It provides the same width(), height() & operator()
+   * interface as Image, with operator() locating the run containing the
+   * requested pixel by binary search within its row, and can therefore be
+   * used with any of the adapters or display functions. Its rows can also
+   * be iterated as runs using row_runs(), which the sixel encoder in
+   * imshow() uses to work directly from the runs.
+   *
+   * Binary masks, such as those produced by thresholding, typically take a
+   * small fraction of the memory of the full image in this form.
+   */
+  template <typename T>
+    class RLEImage {
+      public:
+        //! a run of `second` pixels of value `first`
+        using Run = std::pair<T, int>;
+
+        RLEImage () = default;
+        //! encode an image
+        explicit RLEImage (const Image<T>& image);
+        //! construct from runs in row-major order, as produced by run_length_encode()
+        /** The runs must cover the `width` x `height` image exactly. */
+        RLEImage (const std::vector<Run>& encoded, int width, int height);
+
+        int width () const { return x_dim; }
+        int height () const { return y_dim; }
+        T operator() (int x, int y) const;
+
+        //! the runs making up row `y`
+        std::span<const Run> row_runs (int y) const;
+        //! all runs in row-major order, split at the end of each row
+        const std::vector<Run>& runs () const { return all_runs; }
+
+        //! extract the `width` x `height` region starting at (x, y), without decoding
+        RLEImage crop (int x, int y, int width, int height) const;
+        //! decode into a regular image
+        Image<T> decode () const;
+
+      private:
+        int x_dim = 0, y_dim = 0;
+        std::vector<Run> all_runs;
+        std::vector<int> run_ends;
+        std::vector<std::size_t> row_start;
+
+        void index_runs ();
+        template <typename U> friend RLEImage<U> load_rle_image (const std::string& filename);
+    };
+
+  //! Load an image from a file in the versioned RLE format, without decoding it
+  template <typename T>
+    RLEImage<T> load_rle_image (const std::string& filename);
+
+  //! Losslessly compressed image, made up of independently coded tiles
+  /**
+   * Each `tile_size` x `tile_size` tile is coded as the residuals from a
+   * prediction of each pixel from its neighbours within the tile, using
+   * whichever predictor gives the smallest residuals for that tile: none,
+   * left (row delta), up, Paeth (as in PNG) or the median edge detector
+   * (as in JPEG-LS). The residuals are then Rice-coded in blocks of 16,
+   * each block using its own Rice parameter, with blocks of zero residuals
+   * coded in a few bits. This compresses greyscale content with short runs
+   * far better than run-length encoding.
+   *
+   * Tiles are compressed in parallel, and can be decompressed individually
+   * or in parallel, so that regions of a large image can be decoded on
+   * demand.
+   *
+   * The compressed data, as returned by bytes(), are self-describing: a
+   * 20-byte header (the magic number "TGTC", version, pixel type as for RLE
+   * files, 2 reserved bytes, then width, height & tile size as 32-bit
+   * little-endian integers), the size in bytes of each tile as LEB128
+   * integers, then the tiles themselves in row-major order.
+   *
+   * Only integer pixel types of up to 32 bits are supported.
+   */
+  template <typename T>
+    class CompressedImage {
+      public:
+        CompressedImage () = default;
+        //! compress an image
+        explicit CompressedImage (const Image<T>& image, int tile_size = 64);
+        //! wrap previously compressed data, as returned by bytes()
+        explicit CompressedImage (std::vector<char> data);
+
+        int width () const { return x_dim; }
+        int height () const { return y_dim; }
+        int tile_size () const { return tile; }
+        int tiles_x () const { return x_dim / tile + ( x_dim % tile != 0 ); }
+        int tiles_y () const { return y_dim / tile + ( y_dim % tile != 0 ); }
+
+        //! the compressed data
+        const std::vector<char>& bytes () const { return buffer; }
+
+        //! decompress the whole image, with tiles decoded in parallel
+        Image<T> decode () const;
+        //! decompress the tile at position (tx, ty) in the grid of tiles
+        Image<T> decode_tile (int tx, int ty) const;
+        //! decompress the `width` x `height` region starting at (x, y), decoding only the tiles it overlaps
+        Image<T> decode_region (int x, int y, int width, int height) const;
+
+      private:
+        std::vector<char> buffer;
+        int x_dim = 0, y_dim = 0, tile = 1;
+        std::vector<std::size_t> tile_offsets;
+
+        void index_tiles ();
+        void decode_tile_into (int tx, int ty, T* out, std::size_t stride, int x, int y, int width, int height) const;
+    };
+
+  //! Save compressed image to file
+  template <typename T>
+    void save_compressed (const CompressedImage<T>& image, const std::string& filename);
+
+  //! Load compressed image from file, without decompressing it
+  template <typename T>
+    CompressedImage<T> load_compressed (const std::string& filename);
+
+  //! Decode a run-length encoded image
+  /**
+   * Runs are written in row-major order, using bulk fills that continue
+   * across rows, and bands of the image are decoded in parallel. Runs
+   * beyond the end of the image are ignored, and any pixels not covered by
+   * the runs are left at zero.
+   */
+  template <typename T>
+    Image<T> run_length_decode (const std::vector<std::pair<T, int>>& encoded, int width, int height);
+
+  //! Transform between cartesian & polar images, using precomputed coordinate maps
+  /**
+   * The polar image has one column per radius and one row per angle:
+   * `num_radii` radii evenly spaced from zero up to (but excluding)
+   * `max_radius`, and `num_angles` angles evenly spaced over the full
+   * circle, measured from the x axis towards the y axis, about the centre
+   * (`centre_x`, `centre_y`). By default, there are 360 angles and
+   * `min(width,height)/2` radii spaced one pixel apart, about the centre
+   * `(width/2, height/2)`, rounded down.
+   *
+   * The source coordinates of every sample are computed once on
+   * construction, so that repeated transforms with the same geometry do not
+   * recompute them. Both directions gather their values using bilinear
+   * interpolation (wrapping around in angle), so that the reconstruction
+   * has no holes, and are computed in parallel. Samples falling outside
+   * the source image are set to zero.
+   *
+   * Both the cartesian and polar images need to be at least 2 pixels across.
+   */
+  class PolarTransform {
+    public:
+      PolarTransform (int width, int height, int num_angles = 360, int num_radii = 0, double max_radius = 0.0,
+          double centre_x = std::numeric_limits<double>::quiet_NaN(),
+          double centre_y = std::numeric_limits<double>::quiet_NaN());
+
+      int width () const { return x_dim; }
+      int height () const { return y_dim; }
+      int num_angles () const { return n_angles; }
+      int num_radii () const { return n_radii; }
+      double max_radius () const { return r_max; }
+      double centre_x () const { return cx; }
+      double centre_y () const { return cy; }
+
+      //! resample a `width` x `height` image onto the polar grid
+      template <typename T>
+        Image<T> to_polar (const Image<T>& image) const;
+      //! resample a `num_radii` x `num_angles` polar image back onto the cartesian grid
+      template <typename T>
+        Image<T> to_cartesian (const Image<T>& polar_image) const;
+
+    private:
+      // source pixels (top, top+1, bottom, bottom+1) & weights (in units
+      // of 1/32768) for bilinear interpolation; top is invalid for
+      // samples outside the source image:
+      struct Tap {
+        std::uint32_t top, bottom;
+        std::uint16_t fx, fy;
+      };
+      static constexpr std::uint32_t invalid = std::numeric_limits<std::uint32_t>::max();
+
+      int x_dim, y_dim, n_angles, n_radii;
+      double r_max, cx, cy;
+      std::vector<Tap> polar_map, cartesian_map;
+
+      template <typename T>
+        static Image<T> gather (const Image<T>& source, const std::vector<Tap>& map, int width, int height);
+  };
+
+  //! Convert an image to polar coordinates, optionally smoothed
+  /**
+   * This uses the default geometry of PolarTransform for the image size,
+   * with the coordinate maps cached for subsequent calls. The polar image
+   * is then smoothed using a Gaussian filter of width `sigma`, unless
+   * `sigma` is zero.
+   */
+  template <typename T>
+  TG::Image<T> cartesian_to_polar(const TG::Image<T>& image, double sigma = 1.0);
+
+  //! Convert a polar image back to a `width` x `height` cartesian image
+  /**
+   * This is the inverse of cartesian_to_polar(), for a polar image with one
+   * row per angle over the full circle and radii spaced one pixel apart,
+   * with the coordinate maps cached for subsequent calls.
+   */
+  template <typename T>
+  TG::Image<T> polar_to_cartesian(const TG::Image<T>& polar_image, int width, int height);
+
+  //! Adapter class to magnify an image
+  /**
+   * This makes the image `factor` bigger than the original.
+   */
+  template <class ImageType>
+    class magnify {
+      public:
+        magnify (const ImageType& image, int factor);
+
+        int width () const;
+        int height () const;
+        decltype(std::declval<const ImageType>()(0,0)) operator() (int x, int y) const;
+
+      private:
+        const ImageType& im;
+        const int factor;
+    };
+
+  //! Adapter class to display label images using a limited colourmap
+  /**
+   * Label 0 (background) maps to index 0, and the other labels cycle
+   * through indices 1 to `cmap_size-1`, so that images with any number of
+   * labels can be displayed, e.g. using label_colours():
+   *
+   *     TG::imshow (TG::wrap_labels (labels), TG::label_colours());
+   */
+  template <class ImageType>
+    class wrap_labels {
+      public:
+        wrap_labels (const ImageType& image, int cmap_size = 64);
+
+        int width () const;
+        int height () const;
+        int operator() (int x, int y) const;
+
+      private:
+        const ImageType& im;
+        const int cmap_size;
+    };
+
+  //! Compose a set of images into a single tiled montage
+  /**
+   * The images are laid out in a grid of `columns` tiles across (by
+   * default, as close to square as possible), in row-major order, separated
+   * by `spacing` pixels. Each image is downsampled by averaging over blocks
+   * of `downsample` x `downsample` pixels, and the tiles are sized to fit
+   * the largest of the images. Pixels not covered by any image are set to
+   * zero. The montage is computed in parallel.
+   *
+   * Displaying the result with imshow() sends all images as a single sixel
+   * image with a single palette, rather than one per image, e.g.:
+   *
+   *     TG::imshow (TG::montage (images, 2), 0, 255);
+   *
+   * ImageType can be any class that provides the `width()`, `height()` &
+   * `operator() (int x, int y)` methods.
+   */
+  template <class ImageType>
+    auto montage (const std::vector<ImageType>& images, int downsample = 1, int columns = 0, int spacing = 1)
+      -> Image<std::remove_cvref_t<decltype(std::declval<const ImageType&>()(0,0))>>;
+
+  //! Compose the slices of a volume in the orientation given into a single tiled montage
+  /** \sa montage() */
+  template <typename T>
+    Image<T> montage (const Volume<T>& volume, Orientation orientation, int downsample = 1, int columns = 0, int spacing = 1);
+
+
+
+
+
+  //! Display an indexed image to the terminal, according to the colourmap supplied.
+  /**
+   * ImageType can be any object that implements the following methods:
+   * - `int width() const`
    * - `int height() const`
    * - `integer_type operator() (int x, int y) const`
    *
@@ -735,6 +1394,149 @@ namespace TG {
     void imshow (const ImageType& image, double min, double max, const ColourMap& cmap = gray());
 
 
+  //! Encode an indexed image as the sixel string written by imshow()
+  /**
+   * This allows frames to be encoded ahead of time, possibly on a different
+   * thread, and written to the terminal later. The string includes the
+   * final newline. \sa imshow()
+   */
+  template <class ImageType>
+    std::string sixel_encode (const ImageType& image, const ColourMap& cmap);
+
+  //! Encode a scalar image, rescaled between (min, max), as the sixel string written by imshow()
+  template <class ImageType>
+    std::string sixel_encode (const ImageType& image, double min, double max, const ColourMap& cmap = gray());
+
+
+  //! The intensity range used to map image values to displayed intensities
+  /**
+   * This can be passed to imshow() in place of explicit `min` & `max`
+   * values, and is what the auto_window() and AutoWindow facilities produce.
+   */
+  struct Window {
+    double min, max;
+  };
+
+  //! Display a scalar image to the terminal, rescaled over the Window supplied
+  /**
+   * This is equivalent to `imshow (image, window.min, window.max, cmap)`,
+   * and is convenient in combination with auto_window(), for example:
+   *
+   *     TG::imshow (image, TG::auto_window (image));
+   */
+  template <class ImageType>
+    void imshow (const ImageType& image, const Window& window, const ColourMap& cmap = gray());
+
+  //! Compute a robust display window from the percentiles of the image intensities
+  /**
+   * This returns the `lower` and `upper` percentiles (1% & 99% by default)
+   * of the image intensities, computed from a histogram gathered in a single
+   * pass over the image. This is typically more robust than the full
+   * (min, max) range, which is easily skewed by a few outlying values.
+   *
+   * ImageType can be any object that implements the same methods as
+   * required by imshow(). For 8 & 16-bit integer types, the histogram has
+   * one bin per possible value, and the percentiles are exact. For all other
+   * types (floating-point or wider integers), values are binned according
+   * to their leading 16 bits in single-precision floating-point
+   * representation, which requires no prior knowledge of the range and
+   * provides a relative precision better than 1%. The window is never wider
+   * than the actual range of the data.
+   *
+   * Values that are not finite are ignored.
+   */
+  template <class ImageType>
+    Window auto_window (const ImageType& image, double lower = 1.0, double upper = 99.0);
+
+  //! A class to track the display window over a live sequence of images
+  /**
+   * This is intended for use when displaying a series of frames (e.g. a
+   * running computation or a sequence of slices). Each call to update()
+   * computes the percentile window for the new frame, using the previous
+   * window to set up a fine-grained histogram over the expected range, and
+   * falling back to a full auto_window() computation if the intensities move
+   * outside that range.
+   *
+   * The `smoothing` parameter (between 0 & 1) controls how much of the
+   * previous window is retained at each update, to avoid flickering: with
+   * the default of zero, the window follows each frame exactly.
+   *
+   *     TG::AutoWindow window (1.0, 99.0, 0.8);
+   *     std::cout << TG::Clear;
+   *     while (true) {
+   *       ...
+   *       std::cout << TG::Home;
+   *       TG::imshow (frame, window.update (frame));
+   *     }
+   */
+  class AutoWindow {
+    public:
+      AutoWindow (double lower = 1.0, double upper = 99.0, double smoothing = 0.0);
+
+      //! compute window for next frame, taking previous frames into account
+      template <class ImageType>
+        const Window& update (const ImageType& image);
+
+      //! the current window
+      const Window& window () const;
+      //! forget previous frames
+      void reset ();
+
+    private:
+      const double lower, upper, smoothing;
+      Window current;
+      bool initialised;
+  };
+
+  //! A class to play a sequence of frames at a target frame rate
+  /**
+   * The frames are produced by the function passed to play(), which is
+   * called with the index of each frame in turn, and can return any image
+   * that imshow() accepts - for example by loading each slice from file, or
+   * as a VolumeSlice. A background thread produces the upcoming frames &
+   * encodes them as sixels, into a ring buffer holding up to `buffer_size`
+   * frames, while the calling thread writes each frame in turn at the
+   * TG::Home position, at the target frame rate.
+   *
+   * If playback falls behind, frames are dropped while the next frame is
+   * both ready & due, so that playback catches up. Frames are otherwise
+   * shown as soon as they are ready, if late. The statistics returned
+   * report the number of frames shown & dropped, the time taken to produce
+   * & encode the frames, and the frame rate achieved.
+   *
+   *     std::cout << TG::Clear;
+   *     TG::Player player (10.0);
+   *     auto stats = player.play (filenames.size(),
+   *         [&] (int n) { return load_pgm (filenames[n]); }, 0, 255);
+   *     std::cout << stats.frames_dropped << " frames dropped\n";
+   *
+   * Any exception raised while producing the frames is rethrown by play().
+   */
+  class Player {
+    public:
+      //! Playback statistics, as returned by play()
+      struct Statistics {
+        int frames_shown = 0, frames_dropped = 0;
+        double mean_encode_ms = 0.0, max_encode_ms = 0.0;
+        double frame_rate = 0.0;
+      };
+
+      Player (double fps = 25.0, int buffer_size = 8);
+
+      //! play `num_frames` frames, as returned by `frame (n)`, rescaled between (min, max)
+      template <class FrameSource>
+        Statistics play (int num_frames, FrameSource&& frame, double min, double max, const ColourMap& cmap = gray()) const;
+
+      //! play all slices of a volume in the orientation given, rescaled between (min, max)
+      template <typename T>
+        Statistics play (const Volume<T>& volume, Orientation orientation, double min, double max, const ColourMap& cmap = gray()) const;
+
+    private:
+      const double fps;
+      const int buffer_size;
+  };
+
+
 
 
 
@@ -999,6 +1801,25 @@ namespace TG {
   }
 
 
+  inline ColourMap label_colours (int number)
+  {
+    ColourMap cmap (number);
+    for (int n = 1; n < number; ++n) {
+      // step through hues by the golden ratio, alternating the saturation &
+      // brightness to distinguish colours of similar hue:
+      const double hue = 6.0 * std::fmod (n * 0.618033988749895, 1.0);
+      const double value = n % 2 ? 100.0 : 75.0;
+      const double saturation = n % 3 ? 0.9 : 0.6;
+      auto channel = [&] (double offset) {
+        const double k = std::fmod (offset + hue, 6.0);
+        return ctype (std::round (value * ( 1.0 - saturation * std::clamp (std::min (k, 4.0 - k), 0.0, 1.0) )));
+      };
+      cmap[n] = { channel (5.0), channel (3.0), channel (1.0) };
+    }
+    return cmap;
+  }
+
+
 
 
   // **************************************************************************
@@ -1009,7 +1830,7 @@ namespace TG {
 
   template <typename ValueType>
     inline Image<ValueType>::Image (int x_dim, int y_dim) :
-      data (x_dim*y_dim, 0),
+      buffer (x_dim*y_dim, 0),
       x_dim (x_dim),
       y_dim (y_dim) { }
 
@@ -1028,86 +1849,4916 @@ namespace TG {
   template <typename ValueType>
     inline ValueType& Image<ValueType>::operator() (int x, int y)
     {
-      return data[x+x_dim*y];
+      return buffer[x+x_dim*y];
     }
 
   template <typename ValueType>
     inline const ValueType& Image<ValueType>::operator() (int x, int y) const
     {
-      return data[x+x_dim*y];
+      return buffer[x+x_dim*y];
     }
 
 
   template <typename ValueType>
     inline void Image<ValueType>::clear ()
     {
-      for (auto& x : data)
+      for (auto& x : buffer)
         x = 0;
     }
 
+  template <typename ValueType>
+    inline ValueType* Image<ValueType>::data ()
+    {
+      return buffer.data();
+    }
 
-
+  template <typename ValueType>
+    inline const ValueType* Image<ValueType>::data () const
+    {
+      return buffer.data();
+    }
 
 
 
 
   // **************************************************************************
-  //                   Rescale implementation
+  //                   aligned storage helpers
   // **************************************************************************
 
-  template <class ImageType>
-    inline Rescale<ImageType>::Rescale (const ImageType& image, double minval, double maxval, int cmap_size) :
-      im (image), min (minval), max (maxval), cmap_size (cmap_size) { }
+  namespace {
 
-  template <class ImageType>
-    inline int Rescale<ImageType>::width () const { return im.width(); }
+    // allocator for scratch buffers aligned to cache line boundaries, so
+    // that vectorised loops start on aligned data:
+    template <typename T, std::size_t Alignment = 64>
+      struct AlignedAllocator {
+        using value_type = T;
+        template <typename U> struct rebind { using other = AlignedAllocator<U,Alignment>; };
 
-  template <class ImageType>
-    inline int Rescale<ImageType>::height () const { return im.height(); }
+        AlignedAllocator () = default;
+        template <typename U>
+          AlignedAllocator (const AlignedAllocator<U,Alignment>&) { }
+
+        T* allocate (std::size_t n) {
+          return static_cast<T*> (::operator new (n*sizeof(T), std::align_val_t (Alignment)));
+        }
+        void deallocate (T* p, std::size_t) {
+          ::operator delete (p, std::align_val_t (Alignment));
+        }
+
+        template <typename U>
+          bool operator== (const AlignedAllocator<U,Alignment>&) const { return true; }
+      };
+
+    template <typename T>
+      using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+  }
 
-  template <class ImageType>
-    inline ctype Rescale<ImageType>::operator() (int x, int y) const {
-      double rescaled = cmap_size * (im(x,y) - min) / (max - min);
-      return std::round (std::min (std::max (rescaled, 0.0), cmap_size-1.0));
-    }
 
 
 
   // **************************************************************************
-  //                   magnify implementation
+  //                   parallel processing helpers
   // **************************************************************************
 
-  template <class ImageType>
-    inline magnify<ImageType>::magnify (const ImageType& image, int factor) :
-      im (image), factor (factor) { }
+  namespace {
 
-  template <class ImageType>
-    inline int magnify<ImageType>::width () const { return im.width() * factor; }
+    // minimum number of pixels worth handing over to a separate thread as one chunk:
+    constexpr std::size_t min_pixels_per_chunk = std::size_t(1) << 16;
 
-  template <class ImageType>
-    inline int magnify<ImageType>::height () const { return im.height() * factor; }
+    // number of chunks to split `work` into - this deliberately depends only
+    // on the amount of work, not the number of threads, so that results are
+    // reproducible regardless of thread count:
+    inline int number_of_chunks (std::size_t work, std::size_t min_work = min_pixels_per_chunk)
+    {
+      return static_cast<int> (std::clamp<std::size_t> (work / min_work, 1, 4096));
+    }
 
-  template <class ImageType>
-    inline decltype(std::declval<const ImageType>()(0,0)) magnify<ImageType>::operator() (int x, int y) const {
-      return im (x/factor, y/factor);
+    // number of threads (and hence slot indices) used to process `num_chunks` chunks:
+    inline int number_of_slots (int num_chunks)
+    {
+      return std::clamp (num_chunks, 1, get_num_threads());
     }
 
+  }
 
 
 
-  // **************************************************************************
-  //                   imshow implementation
-  // **************************************************************************
+  // the pool state must be shared by all translation units, so cannot live
+  // in an anonymous namespace:
+  namespace detail {
 
+    // lightweight pool of persistent worker threads. Each job consists of a
+    // fixed number of tasks, dealt out as contiguous ranges of task indices
+    // to each participating thread. Threads process their own range from the
+    // front, then steal from the back of the others' ranges until none
+    // remain.
+    class ThreadPool {
+      public:
+        static ThreadPool& instance ()
+        {
+          static ThreadPool pool;
+          return pool;
+        }
 
+        ~ThreadPool () { stop(); }
 
+        int size () const { return num_threads; }
 
-  // functions in anonymous namespace will remain private to this file:
-  namespace {
+        void resize (int threads)
+        {
+          if (threads <= 0)
+            threads = default_size();
+          std::lock_guard job_lock (job_mutex);
+          stop();
+          num_threads = threads;
+        }
 
-    // helper functions for colourmap handling:
+        // invoke func (slot, task) for each task in [0, num_tasks), over at
+        // most `max_slots` threads each identified by a distinct slot index.
+        // Nested calls, & calls made while another thread is using the pool,
+        // run serially on the calling thread:
+        template <class Functor>
+          void run (int num_tasks, int max_slots, Functor& func)
+          {
+            std::unique_lock job_lock (job_mutex, std::defer_lock);
+            const int slots = std::min ({ num_tasks, max_slots, size() });
+            if (slots <= 1 || in_task() || !job_lock.try_lock()) {
+              for (int task = 0; task < num_tasks; ++task)
+                func (0, task);
+              return;
+            }
+            start();
+
+            for (int n = 0; n < slots; ++n)
+              ranges[n].bounds = pack (std::int64_t (num_tasks)*n/slots, std::int64_t (num_tasks)*(n+1)/slots);
+            {
+              std::lock_guard lock (state_mutex);
+              context = &func;
+              invoke = [] (void* f, int slot, int task) { (*static_cast<Functor*> (f)) (slot, task); };
+              job_slots = slots;
+              finished = 0;
+              error = nullptr;
+              ++generation;
+            }
+            wake.notify_all();
+
+            execute (0);
+
+            std::unique_lock lock (state_mutex);
+            done.wait (lock, [&] { return finished == job_slots-1; });
+            if (error)
+              std::rethrow_exception (error);
+          }
 
-    inline std::string colourmap_specifier (const ColourMap& colours)
+      private:
+        struct alignas(64) Range {
+          std::atomic<std::uint64_t> bounds;
+        };
+
+        int num_threads = default_size();
+        std::vector<std::thread> workers;
+        std::unique_ptr<Range[]> ranges;
+
+        std::mutex job_mutex, state_mutex;
+        std::condition_variable wake, done;
+        void* context = nullptr;
+        void (*invoke) (void*, int, int) = nullptr;
+        int job_slots = 0, finished = 0;
+        std::uint64_t generation = 0;
+        bool stopping = false;
+        std::exception_ptr error;
+
+        ThreadPool () = default;
+
+        static int default_size ()
+        {
+          if (auto value = get_env ("TG_NUM_THREADS")) {
+            const int threads = std::atoi (value->c_str());
+            if (threads > 0)
+              return threads;
+          }
+          return std::max (1U, std::thread::hardware_concurrency());
+        }
+
+        static bool& in_task ()
+        {
+          thread_local bool flag = false;
+          return flag;
+        }
+
+        static std::uint64_t pack (std::uint64_t begin, std::uint64_t end) { return begin | ( end << 32 ); }
+
+        // take the next task from the front of our own range:
+        int take (int slot)
+        {
+          auto& bounds = ranges[slot].bounds;
+          std::uint64_t current = bounds.load();
+          while (( current & 0xFFFFFFFFU ) < ( current >> 32 )) {
+            if (bounds.compare_exchange_weak (current, current + 1))
+              return current & 0xFFFFFFFFU;
+          }
+          return -1;
+        }
+
+        // steal a task from the back of another thread's range:
+        int steal (int slot)
+        {
+          auto& bounds = ranges[slot].bounds;
+          std::uint64_t current = bounds.load();
+          while (( current & 0xFFFFFFFFU ) < ( current >> 32 )) {
+            if (bounds.compare_exchange_weak (current, current - ( std::uint64_t(1) << 32 )))
+              return ( current >> 32 ) - 1;
+          }
+          return -1;
+        }
+
+        void execute (int slot)
+        {
+          auto run_task = [&] (int task) {
+            try {
+              invoke (context, slot, task);
+            }
+            catch (...) {
+              std::lock_guard lock (state_mutex);
+              if (!error)
+                error = std::current_exception();
+            }
+          };
+
+          in_task() = true;
+          for (int task; ( task = take (slot) ) >= 0; )
+            run_task (task);
+          for (int n = 1; n < job_slots; ++n) {
+            const int victim = ( slot + n ) % job_slots;
+            for (int task; ( task = steal (victim) ) >= 0; )
+              run_task (task);
+          }
+          in_task() = false;
+        }
+
+        void worker (int slot, std::uint64_t seen)
+        {
+          while (true) {
+            {
+              std::unique_lock lock (state_mutex);
+              wake.wait (lock, [&] { return stopping || generation != seen; });
+              if (stopping)
+                return;
+              seen = generation;
+              if (slot >= job_slots)
+                continue;
+            }
+            execute (slot);
+            std::lock_guard lock (state_mutex);
+            if (++finished == job_slots-1)
+              done.notify_one();
+          }
+        }
+
+        // launch workers if not already running (job_mutex must be held):
+        void start ()
+        {
+          if (int (workers.size()) == num_threads-1)
+            return;
+          ranges.reset (new Range [num_threads]);
+          stopping = false;
+          for (int n = 1; n < num_threads; ++n)
+            workers.emplace_back ([this, n, seen = generation] () { worker (n, seen); });
+        }
+
+        // shut down workers (job_mutex must be held):
+        void stop ()
+        {
+          {
+            std::lock_guard lock (state_mutex);
+            stopping = true;
+          }
+          wake.notify_all();
+          for (auto& thread : workers)
+            thread.join();
+          workers.clear();
+        }
+    };
+
+  }
+
+
+
+  inline void set_num_threads (int num_threads) { detail::ThreadPool::instance().resize (num_threads); }
+
+  inline int get_num_threads () { return detail::ThreadPool::instance().size(); }
+
+
+
+  namespace {
+
+    // invoke func (slot, begin, end) over `num_chunks` contiguous chunks of
+    // the range [0, size), shared between the threads of the pool. `slot`
+    // identifies the thread processing the chunk, & lies in the range
+    // [0, max_slots) - by default number_of_slots (num_chunks). Functors
+    // must not assume a slot processes a single chunk:
+    template <class Functor>
+      inline void run_in_chunks (std::size_t size, int num_chunks, Functor&& func, int max_slots = 0)
+      {
+        num_chunks = std::clamp<std::size_t> (num_chunks, 1, std::max<std::size_t> (size, 1));
+        if (num_chunks <= 1) {
+          func (0, std::size_t(0), size);
+          return;
+        }
+        auto task = [&] (int slot, int chunk) {
+          func (slot, size*chunk/num_chunks, size*(chunk+1)/num_chunks);
+        };
+        detail::ThreadPool::instance().run (num_chunks, max_slots > 0 ? max_slots : number_of_slots (num_chunks), task);
+      }
+
+
+    // convert floating-point value to pixel type, rounding to the nearest
+    // integer & saturating where necessary:
+    template <typename T>
+      inline T round_to (double val)
+      {
+        if constexpr (std::is_integral_v<T>) {
+          if (!( val > std::numeric_limits<T>::min() ))
+            return std::numeric_limits<T>::min();
+          if (!( val < std::numeric_limits<T>::max() ))
+            return std::numeric_limits<T>::max();
+          return static_cast<T> (std::round (val));
+        }
+        else
+          return static_cast<T> (val);
+      }
+
+    // same for single-precision values: adding 0.5 in double precision is
+    // then exact, so truncation gives the same result as std::round()
+    // without the function call:
+    template <typename T>
+      inline T round_to (float val)
+      {
+        if constexpr (std::is_integral_v<T> && sizeof(T) <= 4) {
+          if (!( val > std::numeric_limits<T>::min() ))
+            return std::numeric_limits<T>::min();
+          if (!( val < std::numeric_limits<T>::max() ))
+            return std::numeric_limits<T>::max();
+          return static_cast<T> (static_cast<long long> (double (val) + ( val < 0.0f ? -0.5 : 0.5 )));
+        }
+        else
+          return round_to<T> (double (val));
+      }
+
+  }
+
+
+
+
+  // **************************************************************************
+  //                   Volume implementation
+  // **************************************************************************
+
+  template <typename ValueType>
+    inline Volume<ValueType>::Volume (int x_dim, int y_dim, int z_dim) :
+      buffer (std::size_t (x_dim)*y_dim*z_dim, 0),
+      x_dim (x_dim),
+      y_dim (y_dim),
+      z_dim (z_dim) { }
+
+
+
+  template <typename ValueType>
+    inline VolumeSlice<ValueType> Volume<ValueType>::slice (Orientation orientation, int index) const
+    {
+      return { *this, orientation, index };
+    }
+
+
+
+  template <typename T>
+    inline Volume<T> map_volume (const std::string& filename, int x_dim, int y_dim, int z_dim, std::size_t offset)
+    {
+      if (x_dim < 0 || y_dim < 0 || z_dim < 0)
+        throw std::invalid_argument ("invalid volume dimensions");
+      const std::size_t bytes = std::size_t (x_dim)*y_dim*z_dim*sizeof(T);
+
+      Volume<T> volume (0, 0, 0);
+      volume.x_dim = x_dim;
+      volume.y_dim = y_dim;
+      volume.z_dim = z_dim;
+      if (!bytes)
+        return volume;
+
+#ifndef _WIN32
+      // voxels can only be used in place if suitably aligned for T:
+      if (offset % alignof(T) == 0) {
+        const int fd = ::open (filename.c_str(), O_RDONLY);
+        if (fd < 0)
+          throw std::runtime_error ("failed to open file \"" + filename + "\"");
+        struct stat info;
+        if (::fstat (fd, &info) || std::size_t (info.st_size) < offset || std::size_t (info.st_size) - offset < bytes) {
+          ::close (fd);
+          throw std::runtime_error ("file \"" + filename + "\" is too small for volume");
+        }
+
+        // the mapping must start on a page boundary:
+        const std::size_t page = ::sysconf (_SC_PAGESIZE);
+        const std::size_t start = offset - offset % page;
+        const std::size_t length = bytes + ( offset - start );
+        void* address = ::mmap (nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+        ::close (fd);
+        if (address == MAP_FAILED)
+          throw std::runtime_error ("failed to map file \"" + filename + "\"");
+        volume.mapped = std::shared_ptr<T> (reinterpret_cast<T*> (static_cast<char*> (address) + ( offset - start )),
+            [address, length] (T*) { ::munmap (address, length); });
+        return volume;
+      }
+#endif
+
+      std::ifstream in (filename, std::ios::binary);
+      if (!in)
+        throw std::runtime_error ("failed to open file \"" + filename + "\"");
+      volume.buffer.resize (bytes / sizeof(T));
+      in.seekg (offset);
+      if (!in.read (reinterpret_cast<char*> (volume.buffer.data()), bytes))
+        throw std::runtime_error ("file \"" + filename + "\" is too small for volume");
+      return volume;
+    }
+
+
+
+  template <typename ValueType>
+    inline VolumeSlice<ValueType>::VolumeSlice (const Volume<ValueType>& volume, Orientation orientation, int index)
+    {
+      const std::ptrdiff_t slice_stride = std::ptrdiff_t (volume.width()) * volume.height();
+      int count;
+      std::ptrdiff_t index_stride;
+      switch (orientation) {
+        case Orientation::AXIAL:
+          count = volume.depth();
+          x_dim = volume.width();
+          y_dim = volume.height();
+          x_stride = 1;
+          y_stride = volume.width();
+          index_stride = slice_stride;
+          break;
+        case Orientation::CORONAL:
+          count = volume.height();
+          x_dim = volume.width();
+          y_dim = volume.depth();
+          x_stride = 1;
+          y_stride = slice_stride;
+          index_stride = volume.width();
+          break;
+        default:
+          count = volume.width();
+          x_dim = volume.height();
+          y_dim = volume.depth();
+          x_stride = volume.width();
+          y_stride = slice_stride;
+          index_stride = 1;
+      }
+      // checked before the origin is computed, since even forming a
+      // pointer beyond the voxel data is undefined:
+      if (index < 0 || index >= count)
+        throw std::invalid_argument ("slice index out of range");
+      origin = volume.data() + index * index_stride;
+    }
+
+
+
+  namespace {
+
+    // project the volume along the axis perpendicular to the orientation
+    // given, combining voxels into accumulators initialised to `init`,
+    // then converting the accumulators to the output type. Each output row
+    // is computed independently, from contiguous rows of voxels:
+    template <typename OutType, typename AccType, typename T, class Combine, class Finish>
+      inline Image<OutType> project_volume (const Volume<T>& volume, Orientation orientation,
+          AccType init, Combine&& combine, Finish&& finish)
+      {
+        const int nx = volume.width(), ny = volume.height(), nz = volume.depth();
+        const int out_width = orientation == Orientation::SAGITTAL ? ny : nx;
+        const int out_height = orientation == Orientation::AXIAL ? ny : nz;
+        Image<OutType> out (out_width, out_height);
+        const std::size_t size = std::size_t (nx) * ny * nz;
+        if (!size)
+          return out;
+
+        run_in_chunks (out_height, number_of_chunks (size), [&] (int, std::size_t begin, std::size_t end) {
+            std::vector<AccType> acc (nx);
+            for (std::size_t row = begin; row < end; ++row) {
+              OutType* dest = out.data() + row * out_width;
+              switch (orientation) {
+                case Orientation::AXIAL:
+                  std::fill (acc.begin(), acc.end(), init);
+                  for (int z = 0; z < nz; ++z) {
+                    const T* voxels = volume.data() + ( std::size_t (z) * ny + row ) * nx;
+                    for (int x = 0; x < nx; ++x)
+                      acc[x] = combine (acc[x], voxels[x]);
+                  }
+                  for (int x = 0; x < nx; ++x)
+                    dest[x] = finish (acc[x]);
+                  break;
+                case Orientation::CORONAL:
+                  std::fill (acc.begin(), acc.end(), init);
+                  for (int y = 0; y < ny; ++y) {
+                    const T* voxels = volume.data() + ( row * ny + y ) * nx;
+                    for (int x = 0; x < nx; ++x)
+                      acc[x] = combine (acc[x], voxels[x]);
+                  }
+                  for (int x = 0; x < nx; ++x)
+                    dest[x] = finish (acc[x]);
+                  break;
+                default:
+                  for (int y = 0; y < ny; ++y) {
+                    const T* voxels = volume.data() + ( row * ny + y ) * nx;
+                    AccType a = init;
+                    for (int x = 0; x < nx; ++x)
+                      a = combine (a, voxels[x]);
+                    dest[y] = finish (a);
+                  }
+              }
+            }
+          });
+        return out;
+      }
+
+  }
+
+
+
+  template <typename T>
+    inline Image<T> maximum_intensity_projection (const Volume<T>& volume, Orientation orientation)
+    {
+      return project_volume<T> (volume, orientation, std::numeric_limits<T>::lowest(),
+          [] (T a, T b) { return b > a ? b : a; },
+          [] (T a) { return a; });
+    }
+
+
+
+  template <typename T>
+    inline Image<float> mean_intensity_projection (const Volume<T>& volume, Orientation orientation)
+    {
+      const int count = orientation == Orientation::AXIAL ? volume.depth() :
+        ( orientation == Orientation::CORONAL ? volume.height() : volume.width() );
+      return project_volume<float> (volume, orientation, 0.0,
+          [] (double a, T b) { return a + b; },
+          [count] (double a) { return float (a / count); });
+    }
+
+
+
+
+  // **************************************************************************
+  //                   histogram implementation
+  // **************************************************************************
+
+  namespace {
+
+    template <class ImageType>
+      using pixel_type = std::remove_cvref_t<decltype(std::declval<const ImageType>()(0,0))>;
+
+    template <typename T>
+      constexpr bool has_direct_histogram = std::is_integral_v<T> && sizeof(T) <= 2;
+
+    // accumulate counts into 4 interleaved sub-histograms, so that successive
+    // increments never target the same memory location:
+    template <typename T, class BinFunctor>
+      inline void accumulate_histogram (const T* data, std::size_t count,
+          unsigned int* counts, std::size_t nbins, BinFunctor&& bin)
+      {
+        unsigned int* h0 = counts;
+        unsigned int* h1 = counts + nbins;
+        unsigned int* h2 = counts + 2*nbins;
+        unsigned int* h3 = counts + 3*nbins;
+
+        std::size_t n = 0;
+        for (; n+4 <= count; n += 4) {
+          ++h0[bin (data[n])];
+          ++h1[bin (data[n+1])];
+          ++h2[bin (data[n+2])];
+          ++h3[bin (data[n+3])];
+        }
+        for (; n < count; ++n)
+          ++h0[bin (data[n])];
+      }
+
+
+    // histogram engine: returns bins [first, last) of the full histogram
+    template <typename T>
+      inline std::vector<int> histogram_engine (const Image<T>& image,
+          int bin_count, double min, double max, int first, int last)
+      {
+        if (bin_count < 1 || !( max > min ))
+          throw std::invalid_argument ("invalid histogram specification");
+
+        const std::size_t size = std::size_t (image.width()) * image.height();
+        const T* data = image.data();
+        const int nchunks = number_of_chunks (size);
+        const double scale = bin_count / ( max - min );
+
+        // with direct histograms, each value has its own entry, subsequently
+        // folded into the requested bins:
+        constexpr bool direct = has_direct_histogram<T>;
+        constexpr long offset = direct ? long (std::numeric_limits<T>::min()) : 0;
+        const std::size_t nentries = direct ? std::size_t(1) << (8*sizeof(T)) : bin_count;
+
+        // one set of counts per thread, accumulated over all its chunks:
+        std::vector<std::vector<unsigned int>> partial (number_of_slots (nchunks));
+        run_in_chunks (size, nchunks, [&] (int slot, std::size_t begin, std::size_t end) {
+            auto& counts = partial[slot];
+            if (counts.empty())
+              counts.assign (4*nentries, 0);
+            if constexpr (direct) {
+              accumulate_histogram (data+begin, end-begin, counts.data(), nentries,
+                  [] (T val) { return std::size_t (long (val) - offset); });
+            }
+            else {
+              accumulate_histogram (data+begin, end-begin, counts.data(), nentries,
+                  [min, scale, bin_count] (T val) {
+                  const double bin = std::floor (( double (val) - min ) * scale);
+                  return static_cast<std::size_t> (std::min (std::max (0.0, bin), bin_count - 1.0));
+                  });
+            }
+          }, partial.size());
+
+        std::vector<int> histogram (last-first, 0);
+        for (std::size_t n = 0; n < nentries; ++n) {
+          std::size_t total = 0;
+          for (const auto& counts : partial)
+            if (counts.size())
+              total += counts[n] + counts[n+nentries] + counts[n+2*nentries] + counts[n+3*nentries];
+          if (!total)
+            continue;
+
+          int bin = n;
+          if constexpr (direct)
+            bin = std::clamp (static_cast<int> (std::floor (( double (long (n) + offset) - min ) * scale)), 0, bin_count-1);
+          if (bin >= first && bin < last)
+            histogram[bin-first] += total;
+        }
+        return histogram;
+      }
+
+
+    // default binning for each type, as { bin_count, min, max }:
+    template <typename T>
+      constexpr std::tuple<int,double,double> default_histogram_bins ()
+      {
+        if constexpr (std::is_same_v<T,bool>)
+          return { 2, 0.0, 2.0 };
+        else if constexpr (has_direct_histogram<T>)
+          return { 1 << (8*sizeof(T)), std::numeric_limits<T>::min(), std::numeric_limits<T>::max() + 1.0 };
+        else if constexpr (std::is_floating_point_v<T>)
+          return { 256, -0.5/255.0, 1.0 + 0.5/255.0 };
+        else {
+          static_assert (std::is_floating_point_v<T>,
+              "no default histogram binning for this type - specify bins explicitly");
+          return { };
+        }
+      }
+
+  }
+
+
+
+  template <typename T>
+    inline std::vector<int> compute_histogram (const Image<T>& image, int bin_count, double min, double max)
+    {
+      return histogram_engine (image, bin_count, min, max, 0, bin_count);
+    }
+
+
+  template <typename T>
+    inline std::vector<int> compute_histogram (const Image<T>& image)
+    {
+      const auto [ bin_count, min, max ] = default_histogram_bins<T>();
+      return histogram_engine (image, bin_count, min, max, 0, bin_count);
+    }
+
+
+  template <typename T>
+    inline std::vector<int> get_histogram_data (const Image<T>& image)
+    {
+      const auto [ bin_count, min, max ] = default_histogram_bins<T>();
+      if (bin_count > 2)
+        return histogram_engine (image, bin_count, min, max, 1, bin_count-1);
+      return histogram_engine (image, bin_count, min, max, 0, bin_count);
+    }
+
+
+
+  template <typename T>
+    inline Image<T> clahe (const Image<T>& image, double clip_limit, int tiles_x, int tiles_y, int bin_count)
+    {
+      static_assert (std::is_arithmetic_v<T> && !std::is_same_v<T,bool>, "clahe() requires a scalar image");
+      if (tiles_x < 1 || tiles_y < 1 || bin_count < 2)
+        throw std::invalid_argument ("invalid CLAHE tiling or bin count");
+
+      const int width = image.width();
+      const int height = image.height();
+      Image<T> output (width, height);
+      if (!width || !height)
+        return output;
+
+      tiles_x = std::min (tiles_x, width);
+      tiles_y = std::min (tiles_y, height);
+      const int tile_width = ( width + tiles_x - 1 ) / tiles_x;
+      const int tile_height = ( height + tiles_y - 1 ) / tiles_y;
+      tiles_x = ( width + tile_width - 1 ) / tile_width;
+      tiles_y = ( height + tile_height - 1 ) / tile_height;
+      const int ntiles = tiles_x * tiles_y;
+
+      // bins span the range of the image, with integer values mapped via a
+      // lookup table:
+      const auto statistics = compute_statistics (image);
+      const double min = statistics.min, max = statistics.max;
+      const double extent = std::is_integral_v<T> ? max - min + 1.0 : max - min;
+      const double scale = extent > 0.0 ? bin_count / extent : 0.0;
+      std::vector<unsigned short> bin_table;
+      if constexpr (has_direct_histogram<T>) {
+        bin_table.resize (std::size_t (1) << (8*sizeof(T)));
+        for (std::size_t n = 0; n < bin_table.size(); ++n)
+          bin_table[n] = std::clamp (static_cast<int> (( long (n) + long (std::numeric_limits<T>::min()) - min ) * scale), 0, bin_count-1);
+      }
+      auto bin_of = [&] (T val) -> std::size_t {
+        if constexpr (has_direct_histogram<T>)
+          return bin_table[long (val) - long (std::numeric_limits<T>::min())];
+        else {
+          // std::max (0.0, NaN) is 0.0, so NaN goes in the first bin, as
+          // for compute_histogram():
+          const double bin = std::floor (( double (val) - min ) * scale);
+          return static_cast<std::size_t> (std::min (std::max (0.0, bin), bin_count - 1.0));
+        }
+      };
+
+      // clipped histogram & equalising lookup table of each tile:
+      std::vector<float> luts (std::size_t (ntiles) * bin_count);
+      run_in_chunks (ntiles, number_of_chunks (std::size_t (width) * height), [&] (int, std::size_t begin, std::size_t end) {
+          std::vector<unsigned int> counts (4 * std::size_t (bin_count));
+          std::vector<double> histogram (bin_count);
+          for (std::size_t tile = begin; tile < end; ++tile) {
+            const int x0 = ( tile % tiles_x ) * tile_width, x1 = std::min (x0 + tile_width, width);
+            const int y0 = ( tile / tiles_x ) * tile_height, y1 = std::min (y0 + tile_height, height);
+            std::fill (counts.begin(), counts.end(), 0);
+            for (int y = y0; y < y1; ++y)
+              accumulate_histogram (image.data() + std::size_t (y) * width + x0, x1 - x0, counts.data(), bin_count, bin_of);
+
+            const double total = double (x1 - x0) * ( y1 - y0 );
+            const double limit = clip_limit > 0.0 ? std::max (1.0, clip_limit * total / bin_count) : total;
+            double excess = 0.0;
+            for (int n = 0; n < bin_count; ++n) {
+              histogram[n] = double (counts[n]) + counts[n+bin_count] + counts[n+2*bin_count] + counts[n+3*bin_count];
+              if (histogram[n] > limit) {
+                excess += histogram[n] - limit;
+                histogram[n] = limit;
+              }
+            }
+
+            // redistribute clipped counts uniformly, & accumulate:
+            float* lut = luts.data() + tile * bin_count;
+            double cumulative = 0.0;
+            for (int n = 0; n < bin_count; ++n) {
+              cumulative += histogram[n] + excess / bin_count;
+              lut[n] = min + ( max - min ) * std::min (cumulative / total, 1.0);
+            }
+          }
+        });
+
+      // position of each column relative to the tile centres:
+      std::vector<int> column_tile (width);
+      std::vector<float> column_weight (width);
+      for (int x = 0; x < width; ++x) {
+        const float fx = ( x + 0.5f ) / tile_width - 0.5f;
+        column_tile[x] = std::clamp (static_cast<int> (std::floor (fx)), 0, tiles_x-1);
+        column_weight[x] = std::clamp (fx - column_tile[x], 0.0f, 1.0f);
+      }
+
+      // interpolate between the lookup tables of the 4 nearest tiles - the
+      // tables of the 2 nearest rows of tiles are blended once per row,
+      // leaving a single interpolation along x per pixel:
+      run_in_chunks (height, number_of_chunks (std::size_t (width) * height), [&] (int, std::size_t begin, std::size_t end) {
+          std::vector<float> row_luts (std::size_t (tiles_x + 1) * bin_count);
+          for (std::size_t y = begin; y < end; ++y) {
+            const float fy = ( y + 0.5f ) / tile_height - 0.5f;
+            const int ty0 = std::clamp (static_cast<int> (std::floor (fy)), 0, tiles_y-1);
+            const int ty1 = std::min (ty0 + 1, tiles_y-1);
+            const float wy = std::clamp (fy - ty0, 0.0f, 1.0f);
+            for (int tx = 0; tx < tiles_x; ++tx) {
+              const float* lut0 = luts.data() + std::size_t (ty0*tiles_x + tx) * bin_count;
+              const float* lut1 = luts.data() + std::size_t (ty1*tiles_x + tx) * bin_count;
+              float* blended = row_luts.data() + std::size_t (tx) * bin_count;
+              for (int n = 0; n < bin_count; ++n)
+                blended[n] = lut0[n] + wy * ( lut1[n] - lut0[n] );
+            }
+            // repeat the last column of tiles, to avoid a branch at the right edge:
+            std::copy_n (row_luts.data() + std::size_t (tiles_x-1) * bin_count, bin_count,
+                row_luts.data() + std::size_t (tiles_x) * bin_count);
+
+            const T* in = image.data() + y*width;
+            T* out = output.data() + y*width;
+            for (int x = 0; x < width; ++x) {
+              const float* lut = row_luts.data() + std::size_t (column_tile[x]) * bin_count + bin_of (in[x]);
+              out[x] = round_to<T> (lut[0] + column_weight[x] * ( lut[bin_count] - lut[0] ));
+            }
+          }
+        });
+
+      return output;
+    }
+
+
+
+
+
+  // **************************************************************************
+  //                   thresholding implementation
+  // **************************************************************************
+
+  namespace {
+
+    // Otsu threshold, without allocation. Empty bins leave the running
+    // sums unchanged and so can never update the threshold: skipping them
+    // gives the same result as the full computation.
+    inline int otsu_threshold (const int* histogram, int nbins, int total)
+    {
+      double sum = 0.0;
+      for (int i = 0; i < nbins; ++i)
+        if (histogram[i])
+          sum += i * ( static_cast<double>(histogram[i]) / total );
+
+      double sumB = 0.0, wB = 0.0;
+      double max_variance = 0.0;
+      int threshold = 0;
+
+      for (int t = 0; t < nbins; ++t) {
+        if (!histogram[t])
+          continue;
+        const double prob = static_cast<double>(histogram[t]) / total;
+        wB += prob;
+        const double wF = 1.0 - wB;
+        if (wF == 0)
+          break;
+
+        sumB += t * prob;
+        const double meanB = sumB / wB;
+        const double meanF = ( sum - sumB ) / wF;
+
+        const double varBetween = wB * wF * ( meanB - meanF ) * ( meanB - meanF );
+        if (varBetween > max_variance) {
+          max_variance = varBetween;
+          threshold = t;
+        }
+      }
+
+      return threshold;
+    }
+
+  }
+
+
+
+
+  template <typename T>
+    inline int compute_otsu_threshold (const std::vector<int>& histogram, int total)
+    {
+      return otsu_threshold (histogram.data(), histogram.size(), total);
+    }
+
+
+
+
+  inline std::vector<int> compute_multi_otsu_thresholds (const std::vector<int>& histogram, int classes)
+  {
+    if (classes < 2)
+      throw std::invalid_argument ("multi-level Otsu requires at least 2 classes");
+
+    // only non-empty bins can delimit a class:
+    std::vector<int> bins;
+    for (std::size_t n = 0; n < histogram.size(); ++n)
+      if (histogram[n] > 0)
+        bins.push_back (n);
+    const int L = bins.size();
+    classes = std::min (classes, L);
+    if (classes < 2)
+      return { };
+
+    // cumulative count & first moment, such that class (i,j] has count
+    // P[j]-P[i] and moment S[j]-S[i]:
+    std::vector<double> P (L+1, 0.0), S (L+1, 0.0);
+    for (int n = 0; n < L; ++n) {
+      P[n+1] = P[n] + histogram[bins[n]];
+      S[n+1] = S[n] + double (histogram[bins[n]]) * bins[n];
+    }
+
+    // maximising the between-class variance is equivalent to maximising
+    // the sum of S^2/P over all classes:
+    auto score = [&] (int i, int j) {
+      const double s = S[j] - S[i];
+      return s*s / ( P[j] - P[i] );
+    };
+
+    // best[j]: best score for splitting the first j bins into k classes,
+    // with split[k][j] the start of the last of these:
+    std::vector<double> best (L+1), previous (L+1);
+    std::vector<std::vector<int>> split (classes, std::vector<int> (L+1, 0));
+    for (int j = 1; j <= L; ++j)
+      best[j] = score (0, j);
+
+    for (int k = 1; k < classes; ++k) {
+      std::swap (best, previous);
+      // the last class must leave at least one bin for each of the k
+      // classes before it, and the remaining classes at least one bin each:
+      const int last = ( k == classes-1 ) ? L : L - ( classes-1-k );
+      for (int j = k+1; j <= last; ++j) {
+        double max_score = -1.0;
+        for (int i = k; i < j; ++i) {
+          const double current = previous[i] + score (i, j);
+          if (current > max_score) {
+            max_score = current;
+            split[k][j] = i;
+          }
+        }
+        best[j] = max_score;
+      }
+    }
+
+    std::vector<int> thresholds (classes-1);
+    for (int k = classes-1, j = L; k > 0; --k) {
+      j = split[k][j];
+      thresholds[k-1] = bins[j-1];
+    }
+    return thresholds;
+  }
+
+
+
+
+  template <typename T>
+    inline Image<unsigned char> apply_thresholds (const Image<T>& image, const std::vector<int>& thresholds)
+    {
+      Image<unsigned char> output (image.width(), image.height());
+      const std::size_t size = std::size_t (image.width()) * image.height();
+      const T* in = image.data();
+      unsigned char* out = output.data();
+      run_in_chunks (size, number_of_chunks (size), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t n = begin; n < end; ++n) {
+            unsigned char label = 0;
+            for (const auto t : thresholds)
+              label += ( in[n] > t );
+            out[n] = label;
+          }
+        });
+      return output;
+    }
+
+
+
+
+  template <typename T>
+    inline Image<unsigned char> adaptive_threshold_blockwise (const Image<T>& image, int block_size)
+    {
+      const int width = image.width();
+      const int height = image.height();
+      const int half_block = block_size / 2;
+      Image<unsigned char> binary_image (width, height);
+
+      auto bin = [] (T val) {
+        if constexpr (std::is_integral_v<T> && sizeof(T) == 1)
+          return static_cast<int> (static_cast<unsigned char> (val));
+        else
+          return std::clamp (static_cast<int> (val), 0, 255);
+      };
+
+      const int nchunks = number_of_chunks (std::size_t (width) * height * ( half_block+1 ));
+      run_in_chunks (height, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          // 'column' holds the histogram of the window at the start of the
+          // current row; 'local' slides along the row from there:
+          std::array<int,256> column, local;
+          column.fill (0);
+          int column_count = 0;
+
+          auto add_row = [&] (int y, int increment) {
+            for (int x = 0; x <= std::min (half_block, width-1); ++x)
+              column[bin (image(x,y))] += increment;
+            column_count += increment * ( std::min (half_block, width-1) + 1 );
+          };
+
+          // start from the window for the row preceding this band:
+          for (int y = begin - half_block - 1; y < static_cast<int>(begin) + half_block; ++y)
+            if (y >= 0 && y < height)
+              add_row (y, 1);
+
+          for (int y = begin; y < static_cast<int>(end); ++y) {
+            const int y1 = std::max (y - half_block, 0);
+            const int y2 = std::min (y + half_block, height - 1);
+            if (y - half_block - 1 >= 0)
+              add_row (y - half_block - 1, -1);
+            if (y + half_block < height)
+              add_row (y + half_block, 1);
+
+            local = column;
+            int count = column_count;
+            for (int x = 0; x < width; ++x) {
+              const int threshold = otsu_threshold (local.data(), local.size(), count);
+              binary_image(x, y) = ( image(x, y) > threshold ) ? 255 : 0;
+
+              // slide window along the row:
+              if (x - half_block >= 0) {
+                for (int j = y1; j <= y2; ++j)
+                  --local[bin (image(x-half_block, j))];
+                count -= y2 - y1 + 1;
+              }
+              if (x + half_block + 1 < width) {
+                for (int j = y1; j <= y2; ++j)
+                  ++local[bin (image(x+half_block+1, j))];
+                count += y2 - y1 + 1;
+              }
+            }
+          }
+        });
+
+      return binary_image;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   Gaussian filtering implementation
+  // **************************************************************************
+
+  namespace {
+
+    // normalised 1-D Gaussian kernel, cached for subsequent use:
+    inline std::shared_ptr<const std::vector<double>> gaussian_kernel (int kernel_size, double sigma)
+    {
+      using key_type = std::pair<int,double>;
+      static std::map<key_type,std::shared_ptr<const std::vector<double>>> cache;
+      static std::mutex mutex;
+      const key_type key (kernel_size, sigma);
+      std::lock_guard<std::mutex> lock (mutex);
+      if (cache.size() >= 32 && !cache.contains (key))
+        cache.clear();
+      auto& entry = cache[key];
+      if (!entry) {
+        const int half_size = kernel_size / 2;
+        auto kernel = std::make_shared<std::vector<double>> (kernel_size);
+        double sum = 0.0;
+        for (int x = -half_size; x <= half_size; ++x)
+          sum += (*kernel)[x+half_size] = std::exp (-(x*x) / (2 * sigma * sigma));
+        for (auto& val : *kernel)
+          val /= sum;
+        entry = kernel;
+      }
+      return entry;
+    }
+
+
+    // Young & van Vliet recursive filter coefficients, as { B, b1/b0, b2/b0, b3/b0 }:
+    inline std::array<double,4> recursive_gaussian_coefficients (double sigma)
+    {
+      const double q = ( sigma >= 2.5 ) ?
+        0.98711*sigma - 0.96330 :
+        3.97156 - 4.14554*std::sqrt (1.0 - 0.26891*sigma);
+      const double q2 = q*q, q3 = q2*q;
+      const double b0 = 1.57825 + 2.44413*q + 1.4281*q2 + 0.422205*q3;
+      const double b1 = 2.44413*q + 2.85619*q2 + 1.26661*q3;
+      const double b2 = -( 1.4281*q2 + 1.26661*q3 );
+      const double b3 = 0.422205*q3;
+      return { 1.0 - ( b1+b2+b3 ) / b0, b1/b0, b2/b0, b3/b0 };
+    }
+
+  }
+
+
+
+
+  template <typename T>
+    inline Image<T> apply_gaussian_filter (const Image<T>& image, int kernel_size, double sigma, GaussianMode mode)
+    {
+      if (kernel_size % 2 == 0)
+        throw std::invalid_argument ("Kernel size must be odd.");
+
+      if (mode == GaussianMode::AUTO)
+        mode = ( kernel_size > 25 && kernel_size >= 5.0*sigma && sigma >= 3.0 ) ? GaussianMode::RECURSIVE : GaussianMode::SEPARABLE;
+      if (mode == GaussianMode::RECURSIVE)
+        return apply_recursive_gaussian_filter (image, sigma);
+
+      const int width = image.width();
+      const int height = image.height();
+      const int half_size = kernel_size / 2;
+      const auto shared_kernel = gaussian_kernel (kernel_size, sigma);
+      const auto& kernel = *shared_kernel;
+      const int nchunks = number_of_chunks (std::size_t (width) * height);
+
+      // along rows, using a copy of each row padded by replicating its ends:
+      std::vector<double> smoothed (std::size_t (width) * height);
+      run_in_chunks (height, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          std::vector<double> padded (width + 2*half_size);
+          for (std::size_t y = begin; y < end; ++y) {
+            const T* in = image.data() + y*width;
+            for (int x = 0; x < width + 2*half_size; ++x)
+              padded[x] = in[std::clamp (x - half_size, 0, width-1)];
+            double* out = smoothed.data() + y*width;
+            for (int x = 0; x < width; ++x) {
+              double sum = 0.0;
+              for (int k = 0; k < kernel_size; ++k)
+                sum += padded[x+k] * kernel[k];
+              out[x] = sum;
+            }
+          }
+        });
+
+      // then down columns, processing whole rows at a time:
+      Image<T> filtered_image (width, height);
+      run_in_chunks (height, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          std::vector<double> sum (width);
+          for (std::size_t y = begin; y < end; ++y) {
+            std::fill (sum.begin(), sum.end(), 0.0);
+            for (int k = 0; k < kernel_size; ++k) {
+              const double* in = smoothed.data() + std::size_t (std::clamp (int(y) + k - half_size, 0, height-1)) * width;
+              const double weight = kernel[k];
+              for (int x = 0; x < width; ++x)
+                sum[x] += in[x] * weight;
+            }
+            T* out = filtered_image.data() + y*width;
+            for (int x = 0; x < width; ++x)
+              out[x] = round_to<T> (sum[x]);
+          }
+        });
+
+      return filtered_image;
+    }
+
+
+
+
+  template <typename T>
+    inline Image<T> apply_recursive_gaussian_filter (const Image<T>& image, double sigma)
+    {
+      if (sigma < 0.5)
+        throw std::invalid_argument ("recursive Gaussian filter requires sigma >= 0.5");
+
+      const int width = image.width();
+      const int height = image.height();
+      const auto [ B, b1, b2, b3 ] = recursive_gaussian_coefficients (sigma);
+      const int nchunks = number_of_chunks (std::size_t (width) * height);
+
+      // causal then anti-causal pass along each row, with the filter state
+      // initialised to the steady-state response to the edge value:
+      std::vector<double> smoothed (std::size_t (width) * height);
+      run_in_chunks (height, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t y = begin; y < end; ++y) {
+            const T* in = image.data() + y*width;
+            double* row = smoothed.data() + y*width;
+            double w1 = in[0], w2 = in[0], w3 = in[0];
+            for (int x = 0; x < width; ++x) {
+              row[x] = B*in[x] + b1*w1 + b2*w2 + b3*w3;
+              w3 = w2; w2 = w1; w1 = row[x];
+            }
+            w1 = w2 = w3 = row[width-1];
+            for (int x = width-1; x >= 0; --x) {
+              row[x] = B*row[x] + b1*w1 + b2*w2 + b3*w3;
+              w3 = w2; w2 = w1; w1 = row[x];
+            }
+          }
+        });
+
+      // same down columns, updating whole rows at a time:
+      Image<T> filtered_image (width, height);
+      run_in_chunks (width, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          auto row = [&] (int y) { return smoothed.data() + std::size_t (std::clamp (y, 0, height-1)) * width; };
+          for (int y = 0; y < height; ++y) {
+            double* current = row (y);
+            const double* w1 = y > 0 ? row (y-1) : current;
+            const double* w2 = y > 1 ? row (y-2) : w1;
+            const double* w3 = y > 2 ? row (y-3) : w2;
+            for (std::size_t x = begin; x < end; ++x)
+              current[x] = B*current[x] + b1*w1[x] + b2*w2[x] + b3*w3[x];
+          }
+          for (int y = height-1; y >= 0; --y) {
+            double* current = row (y);
+            const double* w1 = y < height-1 ? row (y+1) : current;
+            const double* w2 = y < height-2 ? row (y+2) : w1;
+            const double* w3 = y < height-3 ? row (y+3) : w2;
+            T* out = filtered_image.data() + std::size_t (y) * width;
+            for (std::size_t x = begin; x < end; ++x)
+              out[x] = round_to<T> (current[x] = B*current[x] + b1*w1[x] + b2*w2[x] + b3*w3[x]);
+          }
+        });
+
+      return filtered_image;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   bilateral filter implementation
+  // **************************************************************************
+
+  namespace {
+
+    // blur along one axis of the bilateral grid with the [ 1 4 6 4 1 ]/16
+    // kernel, zero beyond the ends. The axis has 'count' entries, 'stride'
+    // floats apart, each holding 'length' contiguous floats to be blurred
+    // together:
+    inline void blur_grid_axis (const float* in, float* out, int count, std::size_t stride, std::size_t length)
+    {
+      constexpr float weights[] = { 1.0f/16.0f, 4.0f/16.0f, 6.0f/16.0f, 4.0f/16.0f, 1.0f/16.0f };
+      for (int n = 0; n < count; ++n) {
+        float* o = out + n*stride;
+        std::fill_n (o, length, 0.0f);
+        for (int k = 0; k < 5; ++k) {
+          const int m = n + k - 2;
+          if (m < 0 || m >= count)
+            continue;
+          const float* i = in + m*stride;
+          const float weight = weights[k];
+          for (std::size_t l = 0; l < length; ++l)
+            o[l] += i[l] * weight;
+        }
+      }
+    }
+
+  }
+
+
+
+
+  template <typename T>
+    inline Image<T> bilateral_filter (const Image<T>& image, double sigma_spatial, double sigma_range)
+    {
+      if (!( sigma_spatial > 0.0 ) || !( sigma_range > 0.0 ))
+        throw std::invalid_argument ("bilateral filter requires positive spatial & range sigmas");
+
+      const int width = image.width();
+      const int height = image.height();
+      Image<T> output (width, height);
+      if (!width || !height)
+        return output;
+
+      // intensity range of the image, over its finite values - infinite
+      // values (including those beyond the range of float) need a second
+      // pass, & non-finite pixels are left unfiltered:
+      const auto statistics = compute_statistics (image);
+      float min = statistics.min, max = statistics.max;
+      if (!std::isfinite (min) || !std::isfinite (max)) {
+        min = std::numeric_limits<float>::infinity();
+        max = -min;
+        for (std::size_t n = 0; n < std::size_t (width) * height; ++n) {
+          const float val = image.data()[n];
+          if (std::isfinite (val)) {
+            min = std::min (min, val);
+            max = std::max (max, val);
+          }
+        }
+        if (min > max) {
+          std::copy_n (image.data(), std::size_t (width) * height, output.data());
+          return output;
+        }
+      }
+      const int nchunks = number_of_chunks (std::size_t (width) * height);
+
+      // grid with a margin of 2 cells for the blur, each cell holding the
+      // sum of intensities & the number of pixels it contains:
+      constexpr int pad = 2;
+      const float ss = sigma_spatial;
+      const int nx = static_cast<int> (( width-1 ) / ss) + 1 + 2*pad;
+      const int ny = static_cast<int> (( height-1 ) / ss) + 1 + 2*pad;
+
+      // the sampling along intensity is coarsened if needed to keep the
+      // grid within budget, otherwise a wide intensity range with a small
+      // sigma_range could require gigabytes. The cells along x & y are set
+      // by sigma_spatial alone, & at least 8 intensity cells are kept, so
+      // large images with a small sigma_spatial can exceed the budget:
+      constexpr std::size_t max_cells = std::size_t (1) << 22;
+      const int max_nz = std::max<std::size_t> (max_cells / ( std::size_t (nx) * ny ), 2*pad + 4);
+      const float sr = std::max<double> (sigma_range, ( double (max) - min ) / ( max_nz - 1 - 2*pad ));
+      const int nz = static_cast<int> (( max - min ) / sr) + 1 + 2*pad;
+      const std::size_t line = std::size_t (nz) * 2, plane = std::size_t (nx) * line;
+      aligned_vector<float> grid (std::size_t (ny) * plane, 0.0f), scratch (grid.size());
+
+      // splat each pixel into its nearest cell. Each row of the grid only
+      // receives pixels from its own rows of the image, so can be filled
+      // independently:
+      std::vector<int> first_row (ny+1, height);
+      for (int y = height-1; y >= 0; --y)
+        first_row[std::lround (y / ss) + pad] = y;
+      for (int gy = ny-1; gy >= 0; --gy)
+        first_row[gy] = std::min (first_row[gy], first_row[gy+1]);
+      run_in_chunks (ny, number_of_chunks (std::size_t (width) * height), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t gy = begin; gy < end; ++gy) {
+            for (int y = first_row[gy]; y < first_row[gy+1]; ++y) {
+              const T* in = image.data() + std::size_t (y) * width;
+              float* cells = grid.data() + gy*plane;
+              for (int x = 0; x < width; ++x) {
+                const float val = in[x];
+                if (!std::isfinite (val))
+                  continue;
+                const int gx = std::lround (x / ss) + pad;
+                const int gz = std::lround (( val - min ) / sr) + pad;
+                float* cell = cells + gx*line + 2*gz;
+                cell[0] += val;
+                cell[1] += 1.0f;
+              }
+            }
+          }
+        });
+
+      // blur along z, x & y in turn:
+      run_in_chunks (ny, number_of_chunks (grid.size()), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t gy = begin; gy < end; ++gy) {
+            for (int gx = 0; gx < nx; ++gx)
+              blur_grid_axis (grid.data() + gy*plane + gx*line, scratch.data() + gy*plane + gx*line, nz, 2, 2);
+            blur_grid_axis (scratch.data() + gy*plane, grid.data() + gy*plane, nx, line, line);
+          }
+        });
+      run_in_chunks (nx, number_of_chunks (grid.size()), [&] (int, std::size_t begin, std::size_t end) {
+          blur_grid_axis (grid.data() + begin*line, scratch.data() + begin*line, ny, plane, ( end - begin ) * line);
+        });
+
+      // slice by trilinear interpolation at each pixel's position:
+      run_in_chunks (height, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t y = begin; y < end; ++y) {
+            const float fy = y / ss + pad;
+            const int y0 = std::min (static_cast<int> (fy), ny-2);
+            const float wy = fy - y0;
+            const T* in = image.data() + y*width;
+            T* out = output.data() + y*width;
+            for (int x = 0; x < width; ++x) {
+              const float val = in[x];
+              if (!std::isfinite (val)) {
+                out[x] = in[x];
+                continue;
+              }
+              const float fx = x / ss + pad;
+              const float fz = ( val - min ) / sr + pad;
+              const int x0 = std::min (static_cast<int> (fx), nx-2);
+              const int z0 = std::min (static_cast<int> (fz), nz-2);
+              const float wx = fx - x0, wz = fz - z0;
+              float sum = 0.0f, weight = 0.0f;
+              for (int j = 0; j < 2; ++j) {
+                for (int i = 0; i < 2; ++i) {
+                  const float* cell = scratch.data() + ( y0+j )*plane + ( x0+i )*line + 2*z0;
+                  const float w = ( j ? wy : 1.0f-wy ) * ( i ? wx : 1.0f-wx );
+                  sum += w * ( ( 1.0f-wz ) * cell[0] + wz * cell[2] );
+                  weight += w * ( ( 1.0f-wz ) * cell[1] + wz * cell[3] );
+                }
+              }
+              out[x] = weight > 0.0f ? round_to<T> (sum / weight) : in[x];
+            }
+          }
+        });
+
+      return output;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   FFT implementation
+  // **************************************************************************
+
+  namespace {
+
+    using complex_type = std::complex<double>;
+
+    // smallest size >= n with no prime factors other than 2, 3 & 5:
+    inline int next_fft_size (int n)
+    {
+      for (;; ++n) {
+        int m = n;
+        for (int p : { 2, 3, 5 })
+          while (m % p == 0)
+            m /= p;
+        if (m == 1)
+          return n;
+      }
+    }
+
+
+    // mixed-radix (2, 3, 4, 5) decimation-in-time FFT of a fixed size:
+    class FFTPlan {
+      public:
+        FFTPlan (int size) : n (size)
+        {
+          int m = n;
+          for (int p : { 4, 2, 3, 5 }) {
+            while (m % p == 0) {
+              m /= p;
+              factors.push_back (p);
+              factors.push_back (m);
+            }
+          }
+          if (m != 1)
+            throw std::invalid_argument ("FFT size must only have factors 2, 3 & 5");
+
+          for (int dir = 0; dir < 2; ++dir) {
+            twiddles[dir].resize (n);
+            for (int k = 0; k < n; ++k)
+              twiddles[dir][k] = std::polar (1.0, ( dir ? 2.0 : -2.0 ) * M_PI * k / n);
+          }
+        }
+
+        int size () const { return n; }
+
+        // out-of-place transform of 'size' values read from 'in' (with
+        // stride 'in_stride') into 'out'. The inverse is not normalised.
+        void transform (const complex_type* in, std::size_t in_stride, complex_type* out, bool inverse) const
+        {
+          if (n == 1)
+            out[0] = in[0];
+          else
+            work (out, in, 1, in_stride, factors.data(), twiddles[inverse ? 1 : 0]);
+        }
+
+      private:
+        const int n;
+        std::vector<int> factors;
+        std::array<std::vector<complex_type>,2> twiddles;
+
+        void work (complex_type* out, const complex_type* in, std::size_t fstride, std::size_t in_stride,
+            const int* factor, const std::vector<complex_type>& twiddle) const
+        {
+          const int p = factor[0], m = factor[1];
+          if (m == 1) {
+            for (int q = 0; q < p; ++q)
+              out[q] = in[q*fstride*in_stride];
+          }
+          else {
+            for (int q = 0; q < p; ++q)
+              work (out + q*m, in + q*fstride*in_stride, fstride*p, in_stride, factor+2, twiddle);
+          }
+
+          // butterflies of radix p over the m sub-transforms:
+          std::array<complex_type,5> scratch;
+          for (int u = 0; u < m; ++u) {
+            for (int q = 0; q < p; ++q)
+              scratch[q] = out[u+q*m];
+            for (int q1 = 0; q1 < p; ++q1) {
+              const std::size_t k = u + q1*m;
+              std::size_t index = 0;
+              complex_type sum = scratch[0];
+              for (int q = 1; q < p; ++q) {
+                index += fstride * k;
+                if (index >= std::size_t (n))
+                  index -= n;
+                sum += scratch[q] * twiddle[index];
+              }
+              out[k] = sum;
+            }
+          }
+        }
+    };
+
+
+    // shared plan for the given size:
+    inline std::shared_ptr<const FFTPlan> get_fft_plan (int size)
+    {
+      static std::map<int,std::shared_ptr<const FFTPlan>> cache;
+      static std::mutex mutex;
+      std::lock_guard<std::mutex> lock (mutex);
+      auto& plan = cache[size];
+      if (!plan)
+        plan = std::make_shared<const FFTPlan> (size);
+      return plan;
+    }
+
+
+    // in-place 2-D transform of nx x ny array, stored in row-major order:
+    inline void fft2d (complex_type* data, const FFTPlan& xplan, const FFTPlan& yplan,
+        bool inverse, std::vector<complex_type>& scratch)
+    {
+      const int nx = xplan.size(), ny = yplan.size();
+      scratch.resize (std::max (nx, ny));
+      for (int y = 0; y < ny; ++y) {
+        xplan.transform (data + std::size_t (y)*nx, 1, scratch.data(), inverse);
+        std::copy_n (scratch.begin(), nx, data + std::size_t (y)*nx);
+      }
+      for (int x = 0; x < nx; ++x) {
+        yplan.transform (data + x, nx, scratch.data(), inverse);
+        for (int y = 0; y < ny; ++y)
+          data[x + std::size_t (y)*nx] = scratch[y];
+      }
+    }
+
+  }
+
+
+
+
+  // **************************************************************************
+  //                   convolution implementation
+  // **************************************************************************
+
+  inline Kernel::Kernel (int size) :
+    dim (size)
+  {
+    if (size < 1 || size % 2 == 0)
+      throw std::invalid_argument ("Kernel size must be a positive odd number.");
+    weights.assign (std::size_t (size)*size, 0.0f);
+  }
+
+  inline Kernel::Kernel (const std::vector<std::vector<float>>& weights) :
+    Kernel (weights.size())
+  {
+    for (int y = 0; y < dim; ++y) {
+      if (static_cast<int> (weights[y].size()) != dim)
+        throw std::invalid_argument ("Kernel must be square.");
+      std::copy (weights[y].begin(), weights[y].end(), this->weights.begin() + y*dim);
+    }
+  }
+
+  inline Kernel::Kernel (std::initializer_list<std::initializer_list<float>> weights) :
+    Kernel (std::vector<std::vector<float>> (weights.begin(), weights.end())) { }
+
+  inline int Kernel::size () const { return dim; }
+
+  inline float& Kernel::operator() (int x, int y) { return weights[x+dim*y]; }
+
+  inline float Kernel::operator() (int x, int y) const { return weights[x+dim*y]; }
+
+  inline const float* Kernel::data () const { return weights.data(); }
+
+
+
+
+  namespace {
+
+    // index of the pixel to use at (possibly out of bounds) position 'x'
+    // along an axis of length 'size', or -1 for a zero-valued pixel:
+    inline int padded_index (int x, int size, PaddingType padding_type)
+    {
+      if (x >= 0 && x < size)
+        return x;
+
+      switch (padding_type) {
+        case PaddingType::ZERO:
+          return -1;
+        case PaddingType::REPLICATE:
+          return std::clamp (x, 0, size - 1);
+        case PaddingType::REFLECT:
+          x = std::abs (x) % (2 * size);
+          return ( x >= size ) ? 2 * size - 1 - x : x;
+        case PaddingType::CIRCULAR:
+          return ( x % size + size ) % size;
+        default:
+          throw std::invalid_argument ("Invalid padding type.");
+      }
+    }
+
+    // lookup table of padded_index() for positions [-pad, size+pad):
+    inline std::vector<int> padding_map (int size, int pad, PaddingType padding_type)
+    {
+      std::vector<int> map (size + 2*pad);
+      for (int x = -pad; x < size+pad; ++x)
+        map[x+pad] = padded_index (x, size, padding_type);
+      return map;
+    }
+
+    // copy row of image into buffer, padded as specified by the map:
+    template <typename T, typename ValueType>
+      inline void fill_padded_row (const Image<T>& image, int y, const std::vector<int>& xmap, ValueType* row)
+      {
+        if (y < 0) {
+          std::fill_n (row, xmap.size(), ValueType (0));
+          return;
+        }
+        const T* in = image.data() + std::size_t (y) * image.width();
+        const int pad = ( xmap.size() - image.width() ) / 2;
+        for (int x = 0; x < pad; ++x) {
+          row[x] = ( xmap[x] < 0 ) ? ValueType (0) : ValueType (in[xmap[x]]);
+          row[xmap.size()-1-x] = ( xmap[xmap.size()-1-x] < 0 ) ? ValueType (0) : ValueType (in[xmap[xmap.size()-1-x]]);
+        }
+        row += pad;
+        for (int x = 0; x < image.width(); ++x)
+          row[x] = in[x];
+      }
+
+
+    // direct convolution, with the kernel size fixed at compile-time if
+    // Size is non-zero:
+    template <int Size, typename T>
+      inline void convolve_direct (const Image<T>& input, const Kernel& kernel, PaddingType padding_type, Image<T>& output)
+      {
+        const int size = Size ? Size : kernel.size();
+        const int pad = size / 2;
+        const int width = input.width();
+        const int height = input.height();
+        const int padded_width = width + 2*pad;
+        const auto xmap = padding_map (width, pad, padding_type);
+        const auto ymap = padding_map (height, pad, padding_type);
+
+        std::array<float,Size*Size> fixed_weights;
+        if constexpr (Size)
+          std::copy_n (kernel.data(), Size*Size, fixed_weights.begin());
+
+        run_in_chunks (height, number_of_chunks (std::size_t (width) * height),
+            [&] (int, std::size_t begin, std::size_t end) {
+            // padded copy of the rows required for the current block of
+            // output rows, small enough to remain in cache:
+            constexpr int block_rows = 32;
+            aligned_vector<float> padded (std::size_t (block_rows + 2*pad) * padded_width);
+            aligned_vector<float> sum (width);
+
+            for (std::size_t y = begin; y < end; ++y) {
+              const int row_in_block = ( y - begin ) % block_rows;
+              if (!row_in_block) {
+                const int nrows = std::min<int> (block_rows, end - y) + 2*pad;
+                for (int j = 0; j < nrows; ++j)
+                  fill_padded_row (input, ymap[y+j], xmap, padded.data() + std::size_t (j) * padded_width);
+              }
+              const float* rows = padded.data() + std::size_t (row_in_block) * padded_width;
+              if constexpr (Size) {
+                // process blocks of adjacent pixels with independent
+                // accumulators, to allow vectorisation across pixels:
+                constexpr int block = 8;
+                int x = 0;
+                for (; x + block <= width; x += block) {
+                  std::array<float,block> val;
+                  val.fill (0.0f);
+                  for (int ky = 0; ky < Size; ++ky)
+                    for (int kx = 0; kx < Size; ++kx)
+                      for (int n = 0; n < block; ++n)
+                        val[n] += rows[ky*padded_width + x + kx + n] * fixed_weights[ky*Size + kx];
+                  std::copy_n (val.begin(), block, sum.begin() + x);
+                }
+                for (; x < width; ++x) {
+                  float val = 0.0f;
+                  for (int ky = 0; ky < Size; ++ky)
+                    for (int kx = 0; kx < Size; ++kx)
+                      val += rows[ky*padded_width + x + kx] * fixed_weights[ky*Size + kx];
+                  sum[x] = val;
+                }
+              }
+              else {
+                std::fill (sum.begin(), sum.end(), 0.0f);
+                for (int ky = 0; ky < size; ++ky) {
+                  for (int kx = 0; kx < size; ++kx) {
+                    const float weight = kernel (kx, ky);
+                    // zero weights can be skipped, unless they might
+                    // need to propagate NaN or infinite values:
+                    if (std::is_integral_v<T> && weight == 0.0f)
+                      continue;
+                    const float* in = rows + ky*padded_width + kx;
+                    for (int x = 0; x < width; ++x)
+                      sum[x] += in[x] * weight;
+                  }
+                }
+              }
+              T* out = output.data() + y*width;
+              for (int x = 0; x < width; ++x)
+                out[x] = round_to<T> (sum[x]);
+            }
+          });
+      }
+
+
+
+    // FFT-based convolution, using overlap-save over tiles of the output:
+    template <typename T>
+      inline void convolve_fft (const Image<T>& input, const Kernel& kernel, PaddingType padding_type, Image<T>& output)
+      {
+        const int size = kernel.size();
+        const int pad = size / 2;
+        const int width = input.width();
+        const int height = input.height();
+        const auto xmap = padding_map (width, pad, padding_type);
+        const auto ymap = padding_map (height, pad, padding_type);
+
+        // transform sizes, large enough for tiles of output a few times the
+        // size of the kernel, but no larger than needed for the image:
+        const int target = std::clamp (4*size, 64, 512);
+        const int nx = next_fft_size (std::min (width, target) + size - 1);
+        const int ny = next_fft_size (std::min (height, target) + size - 1);
+        const int tile_x = nx - size + 1, tile_y = ny - size + 1;
+        const int ntiles_x = ( width + tile_x - 1 ) / tile_x;
+        const int ntiles = ntiles_x * ( ( height + tile_y - 1 ) / tile_y );
+
+        const auto xplan = get_fft_plan (nx);
+        const auto yplan = get_fft_plan (ny);
+
+        // spectrum of flipped kernel, with inverse transform normalisation
+        // folded in, cached for subsequent use:
+        std::shared_ptr<const std::vector<complex_type>> spectrum;
+        {
+          using key_type = std::tuple<int,int,std::vector<float>>;
+          static std::map<key_type,std::shared_ptr<const std::vector<complex_type>>> cache;
+          static std::mutex mutex;
+          key_type key (nx, ny, std::vector<float> (kernel.data(), kernel.data() + size*size));
+          std::lock_guard<std::mutex> lock (mutex);
+          if (cache.size() >= 32 && !cache.contains (key))
+            cache.clear();
+          auto& entry = cache[key];
+          if (!entry) {
+            auto H = std::make_shared<std::vector<complex_type>> (std::size_t (nx)*ny, 0.0);
+            for (int j = 0; j < size; ++j)
+              for (int i = 0; i < size; ++i)
+                (*H)[i + std::size_t (j)*nx] = kernel (size-1-i, size-1-j) / ( double (nx) * ny );
+            std::vector<complex_type> scratch;
+            fft2d (H->data(), *xplan, *yplan, false, scratch);
+            entry = H;
+          }
+          spectrum = entry;
+        }
+
+        // load the padded input for the tile into the real or imaginary
+        // part of the buffer:
+        auto load_tile = [&] (int tile, std::vector<complex_type>& buffer, bool imaginary) {
+          const int x0 = ( tile % ntiles_x ) * tile_x, y0 = ( tile / ntiles_x ) * tile_y;
+          for (int py = 0; py < ny; ++py) {
+            const int y = ( y0 + py < height + 2*pad ) ? ymap[y0+py] : -1;
+            const T* in = ( y >= 0 ) ? input.data() + std::size_t (y) * width : nullptr;
+            complex_type* row = buffer.data() + std::size_t (py)*nx;
+            for (int px = 0; px < nx; ++px) {
+              const int x = ( in && x0 + px < width + 2*pad ) ? xmap[x0+px] : -1;
+              const double val = ( x >= 0 ) ? double (in[x]) : 0.0;
+              row[px] = imaginary ? complex_type (row[px].real(), val) : complex_type (val, 0.0);
+            }
+          }
+        };
+
+        auto store_tile = [&] (int tile, const std::vector<complex_type>& buffer, bool imaginary) {
+          const int x0 = ( tile % ntiles_x ) * tile_x, y0 = ( tile / ntiles_x ) * tile_y;
+          for (int oy = 0; oy < tile_y && y0 + oy < height; ++oy) {
+            const complex_type* row = buffer.data() + std::size_t (oy + size-1)*nx + size-1;
+            T* out = output.data() + std::size_t (y0 + oy) * width + x0;
+            for (int ox = 0; ox < tile_x && x0 + ox < width; ++ox)
+              out[ox] = round_to<T> (imaginary ? row[ox].imag() : row[ox].real());
+          }
+        };
+
+        // the kernel is real, so two tiles can be convolved at once, one
+        // in the real part and the other in the imaginary part:
+        const int npairs = ( ntiles + 1 ) / 2;
+        run_in_chunks (npairs, number_of_chunks (std::size_t (width) * height, min_pixels_per_chunk / 4),
+            [&] (int, std::size_t begin, std::size_t end) {
+            std::vector<complex_type> buffer (std::size_t (nx)*ny), scratch;
+            for (std::size_t pair = begin; pair < end; ++pair) {
+              const int first = 2*pair, second = 2*pair+1;
+              load_tile (first, buffer, false);
+              if (second < ntiles)
+                load_tile (second, buffer, true);
+
+              fft2d (buffer.data(), *xplan, *yplan, false, scratch);
+              for (std::size_t n = 0; n < buffer.size(); ++n)
+                buffer[n] *= (*spectrum)[n];
+              fft2d (buffer.data(), *xplan, *yplan, true, scratch);
+
+              store_tile (first, buffer, false);
+              if (second < ntiles)
+                store_tile (second, buffer, true);
+            }
+          });
+      }
+
+
+    // factorisation of a kernel as the sum of outer products of vertical &
+    // horizontal 1-D kernels, such that kernel(x,y) = sum vertical[n][y] * horizontal[n][x]:
+    struct SeparableKernel {
+      std::vector<std::vector<float>> vertical, horizontal;
+      int rank () const { return vertical.size(); }
+    };
+
+
+    // singular value decomposition by one-sided Jacobi rotations, returning
+    // terms in order of decreasing singular value (folded into 'vertical'):
+    inline SeparableKernel kernel_svd (const Kernel& kernel)
+    {
+      const int n = kernel.size();
+      std::vector<double> A (std::size_t (n)*n), V (std::size_t (n)*n, 0.0);
+      for (int y = 0; y < n; ++y)
+        for (int x = 0; x < n; ++x)
+          A[y+x*n] = kernel (x, y);    // column x of A is column x of the kernel
+      for (int x = 0; x < n; ++x)
+        V[x+x*n] = 1.0;
+
+      for (int sweep = 0; sweep < 60; ++sweep) {
+        bool rotated = false;
+        for (int i = 0; i < n-1; ++i) {
+          for (int j = i+1; j < n; ++j) {
+            double* a = A.data() + i*n;
+            double* b = A.data() + j*n;
+            double alpha = 0.0, beta = 0.0, gamma = 0.0;
+            for (int k = 0; k < n; ++k) {
+              alpha += a[k]*a[k];
+              beta += b[k]*b[k];
+              gamma += a[k]*b[k];
+            }
+            if (std::abs (gamma) <= 1e-15 * std::sqrt (alpha*beta))
+              continue;
+            rotated = true;
+            const double zeta = ( beta - alpha ) / ( 2.0*gamma );
+            const double t = std::copysign (1.0, zeta) / ( std::abs (zeta) + std::sqrt (1.0 + zeta*zeta) );
+            const double c = 1.0 / std::sqrt (1.0 + t*t), s = c*t;
+            double* va = V.data() + i*n;
+            double* vb = V.data() + j*n;
+            for (int k = 0; k < n; ++k) {
+              const double ak = a[k], vak = va[k];
+              a[k] = c*ak - s*b[k];
+              b[k] = s*ak + c*b[k];
+              va[k] = c*vak - s*vb[k];
+              vb[k] = s*vak + c*vb[k];
+            }
+          }
+        }
+        if (!rotated)
+          break;
+      }
+
+      // columns of A are now sigma*u, and of V are v:
+      std::vector<std::pair<double,int>> order;
+      for (int i = 0; i < n; ++i) {
+        double norm = 0.0;
+        for (int k = 0; k < n; ++k)
+          norm += A[k+i*n] * A[k+i*n];
+        order.emplace_back (norm, i);
+      }
+      std::sort (order.begin(), order.end(), std::greater<> ());
+
+      SeparableKernel factors;
+      for (const auto& term : order) {
+        factors.vertical.emplace_back (A.begin() + term.second*n, A.begin() + (term.second+1)*n);
+        factors.horizontal.emplace_back (V.begin() + term.second*n, V.begin() + (term.second+1)*n);
+      }
+      return factors;
+    }
+
+
+    // relative error in reproducing kernel from the first 'rank' terms:
+    inline double separable_error (const Kernel& kernel, const SeparableKernel& factors, int rank)
+    {
+      double error = 0.0, norm = 0.0;
+      for (int y = 0; y < kernel.size(); ++y) {
+        for (int x = 0; x < kernel.size(); ++x) {
+          double val = 0.0;
+          for (int n = 0; n < rank; ++n)
+            val += double (factors.vertical[n][y]) * factors.horizontal[n][x];
+          error += ( val - kernel (x,y) ) * ( val - kernel (x,y) );
+          norm += double (kernel (x,y)) * kernel (x,y);
+        }
+      }
+      return norm > 0.0 ? std::sqrt (error / norm) : 0.0;
+    }
+
+
+    // factorise kernel to the specified tolerance:
+    inline SeparableKernel separable_decomposition (const Kernel& kernel, double tolerance = 1e-6)
+    {
+      const int n = kernel.size();
+
+      // try exact rank-1 factorisation from the row & column through the
+      // largest weight first - this is exact for most common kernels:
+      int px = 0, py = 0;
+      for (int y = 0; y < n; ++y)
+        for (int x = 0; x < n; ++x)
+          if (std::abs (kernel (x,y)) > std::abs (kernel (px,py))) {
+            px = x;
+            py = y;
+          }
+      SeparableKernel factors;
+      if (kernel (px,py) == 0.0f)
+        return factors;
+
+      factors.vertical.emplace_back (n);
+      factors.horizontal.emplace_back (n);
+      for (int k = 0; k < n; ++k) {
+        factors.vertical[0][k] = kernel (px, k);
+        factors.horizontal[0][k] = kernel (k, py) / kernel (px, py);
+      }
+      if (separable_error (kernel, factors, 1) <= tolerance)
+        return factors;
+
+      factors = kernel_svd (kernel);
+      int rank = 1;
+      while (rank < n && separable_error (kernel, factors, rank) > tolerance)
+        ++rank;
+      factors.vertical.resize (rank);
+      factors.horizontal.resize (rank);
+      return factors;
+    }
+
+
+    // separable convolution: horizontal pass over the padded rows, then
+    // vertical pass accumulated over all terms:
+    template <typename T>
+      inline void convolve_separable (const Image<T>& input, const SeparableKernel& factors,
+          PaddingType padding_type, Image<T>& output)
+      {
+        const int size = factors.vertical[0].size();
+        const int pad = size / 2;
+        const int width = input.width();
+        const int height = input.height();
+        const int padded_width = width + 2*pad;
+        const auto xmap = padding_map (width, pad, padding_type);
+        const auto ymap = padding_map (height, pad, padding_type);
+
+        run_in_chunks (height, number_of_chunks (std::size_t (width) * height),
+            [&] (int, std::size_t begin, std::size_t end) {
+            const int block_rows = std::max (32, 2*size);
+            aligned_vector<float> padded (std::size_t (block_rows + 2*pad) * padded_width);
+            aligned_vector<float> horizontal (std::size_t (block_rows + 2*pad) * width);
+            aligned_vector<float> sum (std::size_t (block_rows) * width);
+
+            for (std::size_t y0 = begin; y0 < end; y0 += block_rows) {
+              const int nout = std::min<int> (block_rows, end - y0);
+              const int nrows = nout + 2*pad;
+              for (int j = 0; j < nrows; ++j)
+                fill_padded_row (input, ymap[y0+j], xmap, padded.data() + std::size_t (j) * padded_width);
+
+              std::fill (sum.begin(), sum.end(), 0.0f);
+              for (int n = 0; n < factors.rank(); ++n) {
+                const auto& hkernel = factors.horizontal[n];
+                const auto& vkernel = factors.vertical[n];
+                for (int j = 0; j < nrows; ++j) {
+                  float* out = horizontal.data() + std::size_t (j) * width;
+                  std::fill_n (out, width, 0.0f);
+                  for (int k = 0; k < size; ++k) {
+                    const float weight = hkernel[k];
+                    if (std::is_integral_v<T> && weight == 0.0f)
+                      continue;
+                    const float* in = padded.data() + std::size_t (j) * padded_width + k;
+                    for (int x = 0; x < width; ++x)
+                      out[x] += in[x] * weight;
+                  }
+                }
+                for (int j = 0; j < nout; ++j) {
+                  float* out = sum.data() + std::size_t (j) * width;
+                  for (int k = 0; k < size; ++k) {
+                    const float weight = vkernel[k];
+                    if (std::is_integral_v<T> && weight == 0.0f)
+                      continue;
+                    const float* in = horizontal.data() + std::size_t (j+k) * width;
+                    for (int x = 0; x < width; ++x)
+                      out[x] += in[x] * weight;
+                  }
+                }
+              }
+
+              for (int j = 0; j < nout; ++j) {
+                const float* in = sum.data() + std::size_t (j) * width;
+                T* out = output.data() + ( y0 + j ) * width;
+                for (int x = 0; x < width; ++x)
+                  out[x] = round_to<T> (in[x]);
+              }
+            }
+          });
+      }
+  }
+
+
+
+
+  template <typename T>
+    inline Image<T> convolve (const Image<T>& input, const Kernel& kernel, PaddingType padding_type, ConvolutionMethod method)
+    {
+      Image<T> output (input.width(), input.height());
+      // separable when the passes are cheaper than the full kernel (and
+      // few enough for large kernels to compete with the FFT) - the
+      // specialised direct paths remain faster up to 7x7, so smaller kernels
+      // are not decomposed at all:
+      std::optional<SeparableKernel> factors;
+      if (method == ConvolutionMethod::SEPARABLE || ( method == ConvolutionMethod::AUTO && kernel.size() > 7 ))
+        factors = separable_decomposition (kernel);
+
+      if (method == ConvolutionMethod::AUTO) {
+        const int size = kernel.size(), rank = factors ? factors->rank() : 0;
+        if (rank > 0 && 2*rank < size && ( size < 15 || rank <= 4 ))
+          method = ConvolutionMethod::SEPARABLE;
+        else
+          method = ( size >= 15 ) ? ConvolutionMethod::FFT : ConvolutionMethod::DIRECT;
+      }
+
+      if (method == ConvolutionMethod::SEPARABLE && factors->rank() > 0) {
+        convolve_separable (input, *factors, padding_type, output);
+        return output;
+      }
+      if (method == ConvolutionMethod::FFT) {
+        convolve_fft (input, kernel, padding_type, output);
+        return output;
+      }
+
+      switch (kernel.size()) {
+        case 3: convolve_direct<3> (input, kernel, padding_type, output); break;
+        case 5: convolve_direct<5> (input, kernel, padding_type, output); break;
+        case 7: convolve_direct<7> (input, kernel, padding_type, output); break;
+        default: convolve_direct<0> (input, kernel, padding_type, output);
+      }
+      return output;
+    }
+
+
+
+
+
+  // **************************************************************************
+  //                   IntegralImage implementation
+  // **************************************************************************
+
+  template <typename T>
+    inline IntegralImage<T>::IntegralImage (const Image<T>& image) :
+      x_dim (image.width()),
+      y_dim (image.height()),
+      sums (std::size_t (x_dim+1) * (y_dim+1), 0),
+      square_sums (std::size_t (x_dim+1) * (y_dim+1), 0)
+    {
+      const std::size_t stride = x_dim+1;
+      const int nchunks = number_of_chunks (std::size_t (x_dim) * y_dim);
+
+      // cumulative sums along rows:
+      run_in_chunks (y_dim, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t y = begin; y < end; ++y) {
+            const T* in = image.data() + y*x_dim;
+            sum_type* row = sums.data() + (y+1)*stride + 1;
+            square_sum_type* square_row = square_sums.data() + (y+1)*stride + 1;
+            sum_type sum = 0;
+            square_sum_type square_sum = 0;
+            for (int x = 0; x < x_dim; ++x) {
+              sum += in[x];
+              square_sum += static_cast<square_sum_type> (in[x]) * in[x];
+              row[x] = sum;
+              square_row[x] = square_sum;
+            }
+          }
+        });
+
+      // then down columns:
+      run_in_chunks (stride, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (int y = 1; y < y_dim; ++y) {
+            const std::size_t previous = y*stride, current = (y+1)*stride;
+            for (std::size_t x = begin; x < end; ++x) {
+              sums[current+x] += sums[previous+x];
+              square_sums[current+x] += square_sums[previous+x];
+            }
+          }
+        });
+    }
+
+  template <typename T>
+    inline int IntegralImage<T>::width () const { return x_dim; }
+
+  template <typename T>
+    inline int IntegralImage<T>::height () const { return y_dim; }
+
+  template <typename T>
+    inline void IntegralImage<T>::clip (int& x0, int& y0, int& x1, int& y1) const
+    {
+      x0 = std::clamp (x0, 0, x_dim);
+      x1 = std::clamp (x1, x0, x_dim);
+      y0 = std::clamp (y0, 0, y_dim);
+      y1 = std::clamp (y1, y0, y_dim);
+    }
+
+  template <typename T>
+    template <typename ValueType>
+    inline ValueType IntegralImage<T>::lookup (const std::vector<ValueType>& table, int x0, int y0, int x1, int y1) const
+    {
+      clip (x0, y0, x1, y1);
+      const std::size_t stride = x_dim+1;
+      // accumulate in this order to avoid wrapping of unsigned types:
+      return ( table[y1*stride+x1] + table[y0*stride+x0] ) - table[y0*stride+x1] - table[y1*stride+x0];
+    }
+
+  template <typename T>
+    inline long long IntegralImage<T>::count (int x0, int y0, int x1, int y1) const
+    {
+      clip (x0, y0, x1, y1);
+      return static_cast<long long> (x1-x0) * (y1-y0);
+    }
+
+  template <typename T>
+    inline typename IntegralImage<T>::sum_type IntegralImage<T>::sum (int x0, int y0, int x1, int y1) const
+    {
+      return lookup (sums, x0, y0, x1, y1);
+    }
+
+  template <typename T>
+    inline typename IntegralImage<T>::square_sum_type IntegralImage<T>::sum_of_squares (int x0, int y0, int x1, int y1) const
+    {
+      return lookup (square_sums, x0, y0, x1, y1);
+    }
+
+  template <typename T>
+    inline double IntegralImage<T>::mean (int x0, int y0, int x1, int y1) const
+    {
+      const long long n = count (x0, y0, x1, y1);
+      return n ? static_cast<double> (sum (x0, y0, x1, y1)) / n : NAN;
+    }
+
+  template <typename T>
+    inline double IntegralImage<T>::variance (int x0, int y0, int x1, int y1) const
+    {
+      const long long n = count (x0, y0, x1, y1);
+      if (!n)
+        return NAN;
+      const double mean = static_cast<double> (sum (x0, y0, x1, y1)) / n;
+      return std::max (static_cast<double> (sum_of_squares (x0, y0, x1, y1)) / n - mean*mean, 0.0);
+    }
+
+
+
+
+  namespace {
+
+    // invoke func (x, y, mean, variance) for every pixel, with the
+    // statistics computed over the block centred on it:
+    template <typename T, class Functor>
+      inline void for_each_local_statistics (const Image<T>& image, int block_size, bool need_variance, Functor&& func)
+      {
+        if (block_size < 1)
+          throw std::invalid_argument ("block size must be positive");
+
+        const IntegralImage<T> integral (image);
+        const int before = block_size / 2;
+        const int after = block_size - before;
+        run_in_chunks (image.height(), number_of_chunks (std::size_t (image.width()) * image.height()),
+            [&] (int, std::size_t begin, std::size_t end) {
+            for (int y = begin; y < static_cast<int>(end); ++y) {
+              for (int x = 0; x < image.width(); ++x) {
+                const int x0 = x - before, y0 = y - before, x1 = x + after, y1 = y + after;
+                const double n = integral.count (x0, y0, x1, y1);
+                const double mean = integral.sum (x0, y0, x1, y1) / n;
+                const double variance = need_variance ?
+                  std::max (integral.sum_of_squares (x0, y0, x1, y1) / n - mean*mean, 0.0) : 0.0;
+                func (x, y, mean, variance);
+              }
+            }
+          });
+      }
+
+  }
+
+
+
+  template <typename T>
+    inline Image<float> box_mean (const Image<T>& image, int block_size)
+    {
+      Image<float> output (image.width(), image.height());
+      for_each_local_statistics (image, block_size, false,
+          [&] (int x, int y, double mean, double) { output(x,y) = mean; });
+      return output;
+    }
+
+
+  template <typename T>
+    inline Image<float> box_variance (const Image<T>& image, int block_size)
+    {
+      Image<float> output (image.width(), image.height());
+      for_each_local_statistics (image, block_size, true,
+          [&] (int x, int y, double, double variance) { output(x,y) = variance; });
+      return output;
+    }
+
+
+  template <typename T>
+    inline Image<T> box_blur (const Image<T>& image, int block_size)
+    {
+      Image<T> output (image.width(), image.height());
+      for_each_local_statistics (image, block_size, false,
+          [&] (int x, int y, double mean, double) { output(x,y) = round_to<T> (mean); });
+      return output;
+    }
+
+
+  template <typename T>
+    inline Image<unsigned char> threshold_niblack (const Image<T>& image, int block_size, double k)
+    {
+      Image<unsigned char> output (image.width(), image.height());
+      for_each_local_statistics (image, block_size, true,
+          [&] (int x, int y, double mean, double variance) {
+          output(x,y) = ( image(x,y) > mean + k * std::sqrt (variance) ) ? 255 : 0;
+          });
+      return output;
+    }
+
+
+  template <typename T>
+    inline Image<unsigned char> threshold_sauvola (const Image<T>& image, int block_size, double k, double R)
+    {
+      Image<unsigned char> output (image.width(), image.height());
+      for_each_local_statistics (image, block_size, true,
+          [&] (int x, int y, double mean, double variance) {
+          output(x,y) = ( image(x,y) > mean * ( 1.0 + k * ( std::sqrt (variance) / R - 1.0 ) ) ) ? 255 : 0;
+          });
+      return output;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   median & morphology implementation
+  // **************************************************************************
+
+  namespace {
+
+    // invoke func (padded, padded_width, nrows, y0, nout) for successive
+    // blocks of rows of the image, each padded by 'pad' pixels on all
+    // sides, as required to compute output rows [y0, y0+nout):
+    template <typename T, class Functor>
+      inline void for_each_padded_block (const Image<T>& image, int pad, PaddingType padding_type,
+          std::size_t begin, std::size_t end, Functor&& func)
+      {
+        const int padded_width = image.width() + 2*pad;
+        const auto xmap = padding_map (image.width(), pad, padding_type);
+        const auto ymap = padding_map (image.height(), pad, padding_type);
+        const int block_rows = std::max (32, 4*pad);
+        std::vector<T> padded (std::size_t (block_rows + 2*pad) * padded_width);
+
+        for (std::size_t y0 = begin; y0 < end; y0 += block_rows) {
+          const int nout = std::min<int> (block_rows, end - y0);
+          const int nrows = nout + 2*pad;
+          for (int j = 0; j < nrows; ++j)
+            fill_padded_row (image, ymap[y0+j], xmap, padded.data() + std::size_t (j) * padded_width);
+          func (padded.data(), padded_width, nrows, y0, nout);
+        }
+      }
+
+
+    // two-level histogram tracking the median of a sliding window:
+    template <typename T>
+      class SlidingMedian {
+        public:
+          SlidingMedian (int count) :
+            fine (nentries, 0), coarse (nentries >> shift, 0),
+            rank (( count-1 ) / 2) { }
+
+          void add (T value) {
+            const int n = index (value);
+            ++fine[n];
+            ++coarse[n >> shift];
+            below += ( n < median );
+          }
+
+          void remove (T value) {
+            const int n = index (value);
+            --fine[n];
+            --coarse[n >> shift];
+            below -= ( n < median );
+          }
+
+          // move from the previous median to the current one, skipping
+          // whole blocks of bins where possible:
+          T get () {
+            while (below > rank) {
+              if (( median & block_mask ) == 0 && below - coarse[( median >> shift ) - 1] > rank) {
+                below -= coarse[( median >> shift ) - 1];
+                median -= block_size;
+              }
+              else
+                below -= fine[--median];
+            }
+            while (below + fine[median] <= rank) {
+              if (( median & block_mask ) == 0 && below + coarse[median >> shift] <= rank) {
+                below += coarse[median >> shift];
+                median += block_size;
+              }
+              else
+                below += fine[median++];
+            }
+            return static_cast<T> (median + offset);
+          }
+
+        private:
+          static constexpr int offset = std::numeric_limits<T>::min();
+          static constexpr int nentries = 1 << (8*sizeof(T));
+          static constexpr int shift = sizeof(T) == 1 ? 4 : 8;
+          static constexpr int block_size = 1 << shift;
+          static constexpr int block_mask = block_size - 1;
+
+          std::vector<int> fine, coarse;
+          const int rank;
+          int median = 0, below = 0;
+
+          static int index (T value) { return int (value) - offset; }
+      };
+
+
+    // constant-time median filter for 8-bit images (Perreault & Hebert):
+    // a histogram is maintained for each column of the padded block, updated
+    // by one addition & removal as the window moves down. The window
+    // histogram is then updated along each row by adding & subtracting
+    // whole column histograms, as a coarse histogram of 16 segments, with
+    // each segment of the fine histogram only brought up to date when the
+    // median falls within it:
+    template <typename T>
+      class ConstantTimeMedian {
+        public:
+          ConstantTimeMedian (int size, int padded_width) :
+            size (size), padded_width (padded_width), rank (( size*size - 1 ) / 2),
+            column_fine (std::size_t (padded_width) * 256), column_coarse (std::size_t (padded_width) * 16) { }
+
+          // compute median for rows [0,nout) from the padded block supplied:
+          void process (const T* padded, int width, int nout, T* out, std::size_t out_stride)
+          {
+            std::fill (column_fine.begin(), column_fine.end(), 0);
+            std::fill (column_coarse.begin(), column_coarse.end(), 0);
+            for (int k = 0; k < size; ++k)
+              update_columns (padded + std::size_t (k) * padded_width, 1);
+
+            for (int j = 0; j < nout; ++j) {
+              if (j) {
+                update_columns (padded + std::size_t (j-1) * padded_width, -1);
+                update_columns (padded + std::size_t (j+size-1) * padded_width, 1);
+              }
+              process_row (width, out + j*out_stride);
+            }
+          }
+
+        private:
+          static constexpr int offset = std::numeric_limits<T>::min();
+          const int size, padded_width, rank;
+          std::vector<unsigned short> column_fine, column_coarse;
+
+          void update_columns (const T* row, int increment)
+          {
+            for (int x = 0; x < padded_width; ++x) {
+              const int n = int (row[x]) - offset;
+              column_fine[x*256 + n] += increment;
+              column_coarse[x*16 + ( n >> 4 )] += increment;
+            }
+          }
+
+          void process_row (int width, T* out)
+          {
+            unsigned short coarse[16] = { };
+            unsigned short fine[256];
+            int updated[16];
+            std::fill_n (updated, 16, -size);
+
+            for (int k = 0; k < size; ++k)
+              for (int n = 0; n < 16; ++n)
+                coarse[n] += column_coarse[k*16 + n];
+
+            for (int x = 0; x < width; ++x) {
+              if (x) {
+                const unsigned short* add = column_coarse.data() + std::size_t (x+size-1) * 16;
+                const unsigned short* remove = column_coarse.data() + std::size_t (x-1) * 16;
+                for (int n = 0; n < 16; ++n)
+                  coarse[n] += add[n] - remove[n];
+              }
+
+              int segment = 0, below = 0;
+              while (below + coarse[segment] <= rank)
+                below += coarse[segment++];
+
+              // bring fine histogram for this segment up to date:
+              unsigned short* bins = fine + 16*segment;
+              if (x - updated[segment] >= size) {
+                std::fill_n (bins, 16, 0);
+                for (int k = x; k < x+size; ++k) {
+                  const unsigned short* column = column_fine.data() + std::size_t (k) * 256 + 16*segment;
+                  for (int n = 0; n < 16; ++n)
+                    bins[n] += column[n];
+                }
+              }
+              else {
+                for (int k = updated[segment]; k < x; ++k) {
+                  const unsigned short* add = column_fine.data() + std::size_t (k+size) * 256 + 16*segment;
+                  const unsigned short* remove = column_fine.data() + std::size_t (k) * 256 + 16*segment;
+                  for (int n = 0; n < 16; ++n)
+                    bins[n] += add[n] - remove[n];
+                }
+              }
+              updated[segment] = x;
+
+              int bin = 0;
+              while (below + bins[bin] <= rank)
+                below += bins[bin++];
+              out[x] = static_cast<T> (16*segment + bin + offset);
+            }
+          }
+      };
+
+
+    // median of 3x3 neighbourhoods along a padded row, using the optimal
+    // 19-exchange sorting network. This is branch-free, and processed in
+    // fixed-size blocks via a local buffer so that it vectorises readily;
+    // the last block overlaps the previous one, so the row must be at least
+    // one block wide:
+    constexpr int median3x3_block = 64;
+
+    template <typename T>
+      inline void median3x3_row (const T* r0, const T* r1, const T* r2, int width, T* out)
+      {
+        auto sort = [] (T& a, T& b) { const T t = std::min (a, b); b = std::max (a, b); a = t; };
+        for (int next = 0; next < width; next += median3x3_block) {
+          const int x0 = std::min (next, width - median3x3_block);
+          T result[median3x3_block];
+          for (int n = 0; n < median3x3_block; ++n) {
+            const int x = x0 + n;
+            T p0 = r0[x], p1 = r0[x+1], p2 = r0[x+2];
+            T p3 = r1[x], p4 = r1[x+1], p5 = r1[x+2];
+            T p6 = r2[x], p7 = r2[x+1], p8 = r2[x+2];
+            sort (p1, p2); sort (p4, p5); sort (p7, p8);
+            sort (p0, p1); sort (p3, p4); sort (p6, p7);
+            sort (p1, p2); sort (p4, p5); sort (p7, p8);
+            sort (p0, p3); sort (p5, p8); sort (p4, p7);
+            sort (p3, p6); sort (p1, p4); sort (p2, p5);
+            sort (p4, p7); sort (p4, p2); sort (p6, p4);
+            sort (p4, p2);
+            result[n] = p4;
+          }
+          std::copy_n (result, median3x3_block, out + x0);
+        }
+      }
+
+
+    // van Herk/Gil-Werman running minimum or maximum: out[x] is the result
+    // of op over in[x*stride] ... in[(x+size-1)*stride], for each of 'count'
+    // positions, using blocks of 'size' prefix & suffix values:
+    template <typename T, class Op>
+      inline void running_extremum (const T* in, std::size_t in_stride, int count, int size,
+          T* out, T* prefix, T* suffix, Op op)
+      {
+        const int n = count + size - 1;
+        for (int start = 0; start < n; start += size) {
+          const int end = std::min (start + size, n);
+          prefix[start] = in[start*in_stride];
+          for (int x = start+1; x < end; ++x)
+            prefix[x] = op (prefix[x-1], in[x*in_stride]);
+          suffix[end-1] = in[(end-1)*in_stride];
+          for (int x = end-2; x >= start; --x)
+            suffix[x] = op (suffix[x+1], in[x*in_stride]);
+        }
+        for (int x = 0; x < count; ++x)
+          out[x] = op (suffix[x], prefix[x+size-1]);
+      }
+
+
+    // same, along columns: whole rows of 'width' values are processed at a
+    // time, with row x at in + x*row_stride:
+    template <typename T, class Op>
+      inline void running_extremum_rows (const T* in, std::size_t row_stride, int width, int count, int size,
+          T* out, std::size_t out_stride, T* prefix, T* suffix, Op op)
+      {
+        const int n = count + size - 1;
+        for (int start = 0; start < n; start += size) {
+          const int end = std::min (start + size, n);
+          std::copy_n (in + start*row_stride, width, prefix + std::size_t (start) * width);
+          for (int y = start+1; y < end; ++y) {
+            const T* row = in + y*row_stride;
+            T* p = prefix + std::size_t (y) * width;
+            for (int x = 0; x < width; ++x)
+              p[x] = op (p[x-width], row[x]);
+          }
+          std::copy_n (in + (end-1)*row_stride, width, suffix + std::size_t (end-1) * width);
+          for (int y = end-2; y >= start; --y) {
+            const T* row = in + y*row_stride;
+            T* s = suffix + std::size_t (y) * width;
+            for (int x = 0; x < width; ++x)
+              s[x] = op (s[x+width], row[x]);
+          }
+        }
+        for (int y = 0; y < count; ++y) {
+          const T* s = suffix + std::size_t (y) * width;
+          const T* p = prefix + std::size_t (y+size-1) * width;
+          T* o = out + y*out_stride;
+          for (int x = 0; x < width; ++x)
+            o[x] = op (s[x], p[x]);
+        }
+      }
+
+
+    template <typename T, class Op>
+      inline Image<T> morphology (const Image<T>& image, int size, PaddingType padding_type, Op op)
+      {
+        if (size < 1 || size % 2 == 0)
+          throw std::invalid_argument ("structuring element size must be odd");
+
+        const int width = image.width();
+        const int pad = size / 2;
+        Image<T> output (width, image.height());
+
+        run_in_chunks (image.height(), number_of_chunks (std::size_t (width) * image.height()),
+            [&] (int, std::size_t begin, std::size_t end) {
+            std::vector<T> horizontal, prefix, suffix;
+            for_each_padded_block (image, pad, padding_type, begin, end,
+                [&] (const T* padded, int padded_width, int nrows, std::size_t y0, int nout) {
+                horizontal.resize (std::size_t (nrows) * width);
+                prefix.resize (std::max (std::size_t (nrows) * width, std::size_t (padded_width)));
+                suffix.resize (prefix.size());
+                for (int j = 0; j < nrows; ++j)
+                  running_extremum (padded + std::size_t (j) * padded_width, 1, width, size,
+                      horizontal.data() + std::size_t (j) * width, prefix.data(), suffix.data(), op);
+                running_extremum_rows (horizontal.data(), width, width, nout, size,
+                    output.data() + y0*width, width, prefix.data(), suffix.data(), op);
+                });
+          });
+        return output;
+      }
+
+  }
+
+
+
+
+  template <typename T>
+    inline Image<T> median_filter (const Image<T>& image, int size, PaddingType padding_type)
+    {
+      static_assert (std::is_integral_v<T> && sizeof(T) <= 2 && !std::is_same_v<T,bool>,
+          "median_filter() requires an 8 or 16-bit integer image");
+      if (size < 1 || size % 2 == 0)
+        throw std::invalid_argument ("median filter size must be odd");
+
+      const int width = image.width();
+      const int pad = size / 2;
+      Image<T> output (width, image.height());
+
+      run_in_chunks (image.height(), number_of_chunks (std::size_t (width) * image.height() * size, min_pixels_per_chunk * 8),
+          [&] (int, std::size_t begin, std::size_t end) {
+          SlidingMedian<T> median (size*size);
+          std::optional<ConstantTimeMedian<T>> constant_time;
+          for_each_padded_block (image, pad, padding_type, begin, end,
+              [&] (const T* padded, int padded_width, int, std::size_t y0, int nout) {
+              if constexpr (sizeof(T) == 1) {
+                if (size >= 7 && size <= 255) {
+                  if (!constant_time)
+                    constant_time.emplace (size, padded_width);
+                  constant_time->process (padded, width, nout, output.data() + y0*width, width);
+                  return;
+                }
+              }
+              for (int j = 0; j < nout; ++j) {
+                const T* window = padded + std::size_t (j) * padded_width;
+                T* out = output.data() + ( y0 + j ) * width;
+                if (size == 3 && width >= median3x3_block) {
+                  median3x3_row (window, window + padded_width, window + 2*padded_width, width, out);
+                  continue;
+                }
+                for (int k = 0; k < size; ++k)
+                  for (int x = 0; x < size; ++x)
+                    median.add (window[x + k*padded_width]);
+                out[0] = median.get();
+                for (int x = 1; x < width; ++x) {
+                  for (int k = 0; k < size; ++k) {
+                    median.remove (window[x-1 + k*padded_width]);
+                    median.add (window[x+size-1 + k*padded_width]);
+                  }
+                  out[x] = median.get();
+                }
+                // empty the histogram again, ready for the next row:
+                for (int k = 0; k < size; ++k)
+                  for (int x = width-1; x < width+size-1; ++x)
+                    median.remove (window[x + k*padded_width]);
+              }
+              });
+        });
+      return output;
+    }
+
+
+
+
+  template <typename T>
+    inline Image<T> erode (const Image<T>& image, int size, PaddingType padding_type)
+    {
+      return morphology (image, size, padding_type, [] (T a, T b) { return std::min (a, b); });
+    }
+
+  template <typename T>
+    inline Image<T> dilate (const Image<T>& image, int size, PaddingType padding_type)
+    {
+      return morphology (image, size, padding_type, [] (T a, T b) { return std::max (a, b); });
+    }
+
+  template <typename T>
+    inline Image<T> opening (const Image<T>& image, int size, PaddingType padding_type)
+    {
+      return dilate (erode (image, size, padding_type), size, padding_type);
+    }
+
+  template <typename T>
+    inline Image<T> closing (const Image<T>& image, int size, PaddingType padding_type)
+    {
+      return erode (dilate (image, size, padding_type), size, padding_type);
+    }
+
+
+
+
+  // **************************************************************************
+  //                   distance transform implementation
+  // **************************************************************************
+
+  namespace {
+
+    // squared distance transform, converting each squared distance
+    // (negative if infinite) to the output type:
+    template <typename OutType, typename T, class Convert>
+      inline Image<OutType> compute_distance_transform (const Image<T>& mask, Convert&& convert)
+      {
+        const int width = mask.width(), height = mask.height();
+        const std::size_t size = std::size_t (width) * height;
+        Image<OutType> out (width, height);
+        if (!size)
+          return out;
+
+        // distance to the nearest zero pixel along each column, using a
+        // forward & a backward sweep over strips of columns; distances of
+        // at least `far` are infinite:
+        const int far = width + height;
+        std::vector<int> column_distance (size);
+        const int nstrips = std::min<std::size_t> (number_of_chunks (size), ( width + 63 ) / 64);
+        run_in_chunks (width, nstrips, [&] (int, std::size_t begin, std::size_t end) {
+            const int x0 = begin, x1 = end;
+            const T* in = mask.data();
+            int* g = column_distance.data();
+            for (int x = x0; x < x1; ++x)
+              g[x] = in[x] != 0 ? far : 0;
+            for (int y = 1; y < height; ++y) {
+              const T* row = in + std::size_t (y) * width;
+              int* current = g + std::size_t (y) * width;
+              const int* previous = current - width;
+              for (int x = x0; x < x1; ++x)
+                current[x] = row[x] != 0 ? std::min (previous[x] + 1, far) : 0;
+            }
+            for (int y = height-2; y >= 0; --y) {
+              int* current = g + std::size_t (y) * width;
+              const int* next = current + width;
+              for (int x = x0; x < x1; ++x)
+                current[x] = std::min (current[x], next[x] + 1);
+            }
+          });
+
+        // lower envelope of the parabolas (x-q)^2 + g(q)^2 along each row:
+        run_in_chunks (height, number_of_chunks (size), [&] (int, std::size_t begin, std::size_t end) {
+            std::vector<long long> f (width);
+            std::vector<int> v (width);
+            std::vector<double> z (width + 1);
+            for (std::size_t y = begin; y < end; ++y) {
+              const int* g = column_distance.data() + y * width;
+              OutType* row = out.data() + y * width;
+
+              int k = -1;
+              for (int q = 0; q < width; ++q) {
+                if (g[q] >= far)
+                  continue;
+                f[q] = (long long) g[q] * g[q];
+                if (k < 0) {
+                  k = 0;
+                  v[0] = q;
+                  z[0] = -std::numeric_limits<double>::infinity();
+                  z[1] = std::numeric_limits<double>::infinity();
+                  continue;
+                }
+                double s;
+                while (true) {
+                  const int p = v[k];
+                  s = double (( f[q] + (long long) q*q ) - ( f[p] + (long long) p*p )) / ( 2.0 * ( q - p ) );
+                  if (s > z[k])
+                    break;
+                  --k;
+                }
+                ++k;
+                v[k] = q;
+                z[k] = s;
+                z[k+1] = std::numeric_limits<double>::infinity();
+              }
+
+              if (k < 0) {
+                std::fill_n (row, width, convert (-1));
+                continue;
+              }
+              k = 0;
+              for (int x = 0; x < width; ++x) {
+                while (z[k+1] < x)
+                  ++k;
+                const long long dx = x - v[k];
+                row[x] = convert (dx*dx + f[v[k]]);
+              }
+            }
+          });
+
+        return out;
+      }
+
+  }
+
+
+
+
+
+  template <typename T>
+    inline Image<float> distance_transform (const Image<T>& mask)
+    {
+      return compute_distance_transform<float> (mask, [] (long long d2) {
+          return d2 < 0 ? std::numeric_limits<float>::infinity() : std::sqrt (float (d2));
+        });
+    }
+
+
+
+  template <typename T>
+    inline Image<unsigned int> squared_distance_transform (const Image<T>& mask)
+    {
+      return compute_distance_transform<unsigned int> (mask, [] (long long d2) {
+          constexpr long long max = std::numeric_limits<unsigned int>::max();
+          return static_cast<unsigned int> (d2 < 0 || d2 > max ? max : d2);
+        });
+    }
+
+
+
+
+  // **************************************************************************
+  //                   edge detection implementation
+  // **************************************************************************
+
+  namespace {
+
+    // accumulator type for gradient computations:
+    template <typename T>
+      using gradient_type = std::conditional_t<std::is_integral_v<T> && sizeof(T) <= 2, int, float>;
+
+    // weights of the gradient operators, across the derivative:
+    inline std::array<int,2> gradient_weights (GradientOperator op)
+    {
+      return op == GradientOperator::SCHARR ? std::array<int,2> { 3, 10 } : std::array<int,2> { 1, 2 };
+    }
+
+    // derivatives along a row, from the 3 rows (padded by one pixel) centred on it:
+    template <typename A>
+      inline void gradient_row (const A* r0, const A* r1, const A* r2, int width,
+          std::array<int,2> weights, A* gx, A* gy)
+      {
+        const A a = weights[0], b = weights[1];
+        for (int x = 0; x < width; ++x) {
+          gx[x] = a * ( r0[x+2] - r0[x] ) + b * ( r1[x+2] - r1[x] ) + a * ( r2[x+2] - r2[x] );
+          gy[x] = a * ( r2[x] - r0[x] ) + b * ( r2[x+1] - r0[x+1] ) + a * ( r2[x+2] - r0[x+2] );
+        }
+      }
+
+  }
+
+
+
+
+  template <typename T>
+    inline Gradient compute_gradient (const Image<T>& image, GradientOperator op,
+        PaddingType padding_type, bool with_orientation)
+    {
+      using A = gradient_type<T>;
+      const int width = image.width();
+      const int height = image.height();
+      const auto weights = gradient_weights (op);
+      const auto xmap = padding_map (width, 1, padding_type);
+      const auto ymap = padding_map (height, 1, padding_type);
+
+      Gradient gradient { Image<float> (width, height),
+        Image<float> (with_orientation ? width : 0, with_orientation ? height : 0) };
+
+      run_in_chunks (height, number_of_chunks (std::size_t (width) * height),
+          [&] (int, std::size_t begin, std::size_t end) {
+          // ring buffer of padded rows, each tagged with its row index:
+          std::vector<A> rows (3 * std::size_t (width+2)), gx (width), gy (width);
+          int tags[3] = { -2, -2, -2 };
+          auto row = [&] (int y) {
+            const int slot = ( y + 3 ) % 3;
+            A* ptr = rows.data() + std::size_t (slot) * ( width+2 );
+            if (tags[slot] != y) {
+              fill_padded_row (image, ymap[y+1], xmap, ptr);
+              tags[slot] = y;
+            }
+            return ptr;
+          };
+
+          for (int y = begin; y < static_cast<int>(end); ++y) {
+            gradient_row (row (y-1), row (y), row (y+1), width, weights, gx.data(), gy.data());
+            float* magnitude = gradient.magnitude.data() + std::size_t (y) * width;
+            for (int x = 0; x < width; ++x)
+              magnitude[x] = std::sqrt (float (gx[x]) * float (gx[x]) + float (gy[x]) * float (gy[x]));
+            if (with_orientation) {
+              float* orientation = gradient.orientation.data() + std::size_t (y) * width;
+              for (int x = 0; x < width; ++x)
+                orientation[x] = std::atan2 (float (gy[x]), float (gx[x]));
+            }
+          }
+        });
+
+      return gradient;
+    }
+
+
+
+
+  template <typename T>
+    inline Image<unsigned char> canny (const Image<T>& image, double low_threshold, double high_threshold, double sigma, GradientOperator op)
+    {
+      if (low_threshold > high_threshold)
+        throw std::invalid_argument ("Canny low threshold must not exceed high threshold");
+
+      const int width = image.width();
+      const int height = image.height();
+      const auto weights = gradient_weights (op);
+      const int radius = sigma > 0.0 ? std::max (1, static_cast<int> (std::ceil (3.0*sigma))) : 0;
+      const int nblurred = 2*radius+1;
+      std::vector<float> kernel (nblurred, 1.0f);
+      if (radius) {
+        const auto gaussian = gaussian_kernel (nblurred, sigma);
+        kernel.assign (gaussian->begin(), gaussian->end());
+      }
+      const auto xmap = padding_map (width, radius, PaddingType::REPLICATE);
+
+      // 0: not an edge, 1: weak edge, 2: strong edge:
+      Image<unsigned char> edges (width, height);
+
+      run_in_chunks (height, number_of_chunks (std::size_t (width) * height * ( radius+2 )),
+          [&] (int, std::size_t begin, std::size_t end) {
+          // each stage is held as a ring buffer of rows, computed on demand
+          // & tagged with the index of the row they currently hold:
+          std::vector<float> padded (width + 2*radius);
+          std::vector<float> blurred (std::size_t (nblurred) * width), smoothed (3 * std::size_t (width+2));
+          std::vector<float> magnitudes (3 * std::size_t (width+2)), gx (3 * std::size_t (width)), gy (3 * std::size_t (width));
+          std::vector<int> blurred_tags (nblurred, -1), smoothed_tags (3, -1), gradient_tags (3, -2);
+
+          // input row y (within the image) smoothed along x:
+          auto blurred_row = [&] (int y) {
+            float* out = blurred.data() + std::size_t (y % nblurred) * width;
+            if (blurred_tags[y % nblurred] != y) {
+              fill_padded_row (image, y, xmap, padded.data());
+              std::fill_n (out, width, 0.0f);
+              for (int k = 0; k < nblurred; ++k) {
+                const float weight = kernel[k];
+                for (int x = 0; x < width; ++x)
+                  out[x] += padded[x+k] * weight;
+              }
+              blurred_tags[y % nblurred] = y;
+            }
+            return out;
+          };
+
+          // smoothed row, replicated beyond the image & padded by one pixel:
+          auto smoothed_row = [&] (int y) {
+            y = std::clamp (y, 0, height-1);
+            float* out = smoothed.data() + std::size_t (y % 3) * ( width+2 );
+            if (smoothed_tags[y % 3] != y) {
+              std::fill_n (out+1, width, 0.0f);
+              for (int k = 0; k < nblurred; ++k) {
+                const float* in = blurred_row (std::clamp (y + k - radius, 0, height-1));
+                const float weight = kernel[k];
+                for (int x = 0; x < width; ++x)
+                  out[x+1] += in[x] * weight;
+              }
+              out[0] = out[1];
+              out[width+1] = out[width];
+              smoothed_tags[y % 3] = y;
+            }
+            return out;
+          };
+
+          // gradient magnitude row padded by one pixel, zero beyond the image,
+          // keeping the derivatives in the corresponding slot:
+          auto gradient_at = [&] (int y) {
+            const int slot = ( y + 3 ) % 3;
+            float* out = magnitudes.data() + std::size_t (slot) * ( width+2 );
+            if (gradient_tags[slot] != y) {
+              gradient_tags[slot] = y;
+              std::fill_n (out, width+2, 0.0f);
+              if (y >= 0 && y < height) {
+                float* dx = gx.data() + std::size_t (slot) * width;
+                float* dy = gy.data() + std::size_t (slot) * width;
+                gradient_row (smoothed_row (y-1), smoothed_row (y), smoothed_row (y+1), width, weights, dx, dy);
+                for (int x = 0; x < width; ++x)
+                  out[x+1] = std::sqrt (dx[x]*dx[x] + dy[x]*dy[x]);
+              }
+            }
+            return out;
+          };
+
+          // non-maximum suppression along the gradient direction (quantised
+          // to the nearest 45 degrees), & classification:
+          constexpr float tan22 = 0.41421356f, tan67 = 2.41421356f;
+          for (int y = begin; y < static_cast<int>(end); ++y) {
+            const float* above = gradient_at (y-1);
+            const float* below = gradient_at (y+1);
+            const float* current = gradient_at (y);
+            const float* dx = gx.data() + std::size_t (( y + 3 ) % 3) * width;
+            const float* dy = gy.data() + std::size_t (( y + 3 ) % 3) * width;
+            unsigned char* out = edges.data() + std::size_t (y) * width;
+            for (int x = 0; x < width; ++x) {
+              const float m = current[x+1];
+              if (!( m > low_threshold )) {
+                out[x] = 0;
+                continue;
+              }
+              const float ax = std::abs (dx[x]), ay = std::abs (dy[x]);
+              float n1, n2;
+              if (ay <= ax * tan22) {
+                n1 = current[x];
+                n2 = current[x+2];
+              }
+              else if (ay >= ax * tan67) {
+                n1 = above[x+1];
+                n2 = below[x+1];
+              }
+              else if (( dx[x] > 0.0f ) == ( dy[x] > 0.0f )) {
+                n1 = above[x];
+                n2 = below[x+2];
+              }
+              else {
+                n1 = above[x+2];
+                n2 = below[x];
+              }
+              out[x] = ( m > n1 && m >= n2 ) ? ( m > high_threshold ? 2 : 1 ) : 0;
+            }
+          }
+        });
+
+      // hysteresis: trace weak edges connected to strong ones:
+      unsigned char* map = edges.data();
+      const std::size_t size = std::size_t (width) * height;
+      std::vector<std::size_t> stack;
+      for (std::size_t n = 0; n < size; ++n) {
+        if (map[n] != 2)
+          continue;
+        map[n] = 255;
+        stack.push_back (n);
+        while (stack.size()) {
+          const std::size_t index = stack.back();
+          stack.pop_back();
+          const int x = index % width, y = index / width;
+          for (int j = std::max (y-1, 0); j <= std::min (y+1, height-1); ++j) {
+            for (int i = std::max (x-1, 0); i <= std::min (x+1, width-1); ++i) {
+              const std::size_t neighbour = i + std::size_t (j) * width;
+              if (map[neighbour] == 1) {
+                map[neighbour] = 255;
+                stack.push_back (neighbour);
+              }
+            }
+          }
+        }
+      }
+      for (std::size_t n = 0; n < size; ++n)
+        if (map[n] != 255)
+          map[n] = 0;
+
+      return edges;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   connected components implementation
+  // **************************************************************************
+
+  namespace {
+
+    // run of non-zero pixels over [start, end) on row y:
+    struct ForegroundRun {
+      int start, end, y;
+    };
+
+
+    // append the runs of non-zero pixels of row y:
+    template <class ImageType>
+      inline void scan_foreground_runs (const ImageType& mask, int y, std::vector<ForegroundRun>& runs)
+      {
+        if constexpr (HasRowRuns<ImageType>) {
+          int x = 0;
+          bool extend = false;
+          for (const auto& [value, count] : mask.row_runs (y)) {
+            if (value != 0) {
+              if (extend)
+                runs.back().end += count;
+              else
+                runs.push_back ({ x, x + int (count), y });
+            }
+            extend = value != 0;
+            x += count;
+          }
+        }
+        else {
+          const int width = mask.width();
+          for (int x = 0; x < width; ++x) {
+            if (mask (x, y) == 0)
+              continue;
+            const int start = x;
+            while (x < width && mask (x, y) != 0)
+              ++x;
+            runs.push_back ({ start, x, y });
+          }
+        }
+      }
+
+
+    // union-find with path halving; the root of each set is its lowest
+    // index, which is also its first run in raster order:
+    inline int find_root (std::vector<int>& parent, int n)
+    {
+      while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+      }
+      return n;
+    }
+
+    inline void unite (std::vector<int>& parent, int a, int b)
+    {
+      a = find_root (parent, a);
+      b = find_root (parent, b);
+      if (a < b)
+        parent[b] = a;
+      else if (b < a)
+        parent[a] = b;
+    }
+
+
+    // join the runs in [a, a_end) with those they touch in [b, b_end) on
+    // the next row, where touching runs may be up to `reach` pixels apart:
+    inline void join_runs (const std::vector<ForegroundRun>& runs, std::vector<int>& parent,
+        int a, int a_end, int b, int b_end, int reach)
+    {
+      while (a < a_end && b < b_end) {
+        if (runs[a].start < runs[b].end + reach && runs[b].start < runs[a].end + reach)
+          unite (parent, a, b);
+        if (runs[a].end < runs[b].end)
+          ++a;
+        else
+          ++b;
+      }
+    }
+
+  }
+
+
+
+
+  template <class ImageType>
+    inline Components connected_components (const ImageType& mask, int connectivity)
+    {
+      if (connectivity != 4 && connectivity != 8)
+        throw std::invalid_argument ("connectivity must be 4 or 8");
+      const int width = mask.width(), height = mask.height();
+      const int reach = connectivity == 8 ? 1 : 0;
+
+      // scan runs & join them within bands of rows, in parallel:
+      const int nbands = std::min (number_of_chunks (std::size_t (width) * height), std::max (height, 1));
+      std::vector<std::vector<ForegroundRun>> band_runs (nbands);
+      std::vector<std::vector<int>> band_parents (nbands);
+      std::vector<int> row_offsets (height + 1, 0);
+      run_in_chunks (nbands, nbands, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t band = begin; band < end; ++band) {
+            auto& runs = band_runs[band];
+            auto& parent = band_parents[band];
+            const int y0 = std::size_t (height) * band / nbands, y1 = std::size_t (height) * ( band + 1 ) / nbands;
+            int previous = 0;
+            for (int y = y0; y < y1; ++y) {
+              const int current = runs.size();
+              scan_foreground_runs (mask, y, runs);
+              row_offsets[y+1] = runs.size() - current;
+              parent.resize (runs.size());
+              std::iota (parent.begin() + current, parent.end(), current);
+              if (y > y0)
+                join_runs (runs, parent, previous, current, current, runs.size(), reach);
+              previous = current;
+            }
+          }
+        });
+
+      // gather the bands together, & join runs across band boundaries:
+      std::vector<ForegroundRun> runs;
+      std::vector<int> parent;
+      for (int band = 0; band < nbands; ++band) {
+        const int offset = runs.size();
+        runs.insert (runs.end(), band_runs[band].begin(), band_runs[band].end());
+        for (int p : band_parents[band])
+          parent.push_back (p + offset);
+        band_runs[band] = {};
+        band_parents[band] = {};
+      }
+      for (int y = 0; y < height; ++y)
+        row_offsets[y+1] += row_offsets[y];
+      for (int band = 1; band < nbands; ++band) {
+        const int y = std::size_t (height) * band / nbands;
+        if (y > 0 && y < height)
+          join_runs (runs, parent, row_offsets[y-1], row_offsets[y], row_offsets[y], row_offsets[y+1], reach);
+      }
+
+      // label runs in raster order, gathering statistics as we go:
+      Components result { Image<int> (width, height), { } };
+      std::vector<int> run_labels (runs.size());
+      std::vector<std::array<double,2>> sums;
+      for (std::size_t n = 0; n < runs.size(); ++n) {
+        const auto& run = runs[n];
+        const int root = find_root (parent, n);
+        if (root == int (n)) {
+          result.components.push_back ({ 0, run.start, run.y, run.end-1, run.y, 0.0, 0.0 });
+          sums.push_back ({ 0.0, 0.0 });
+          run_labels[n] = result.components.size();
+        }
+        else
+          run_labels[n] = run_labels[root];
+
+        auto& component = result.components[run_labels[n]-1];
+        const std::size_t length = run.end - run.start;
+        component.area += length;
+        component.x_min = std::min (component.x_min, run.start);
+        component.x_max = std::max (component.x_max, run.end-1);
+        component.y_max = run.y;
+        sums[run_labels[n]-1][0] += 0.5 * length * ( run.start + run.end - 1 );
+        sums[run_labels[n]-1][1] += double (length) * run.y;
+      }
+      for (std::size_t c = 0; c < sums.size(); ++c) {
+        result.components[c].centroid_x = sums[c][0] / result.components[c].area;
+        result.components[c].centroid_y = sums[c][1] / result.components[c].area;
+      }
+
+      // fill label image from the runs, in parallel:
+      int* labels = result.labels.data();
+      run_in_chunks (height, number_of_chunks (std::size_t (width) * height), [&] (int, std::size_t begin, std::size_t end) {
+          for (int n = row_offsets[begin]; n < row_offsets[end]; ++n)
+            std::fill (labels + std::size_t (runs[n].y) * width + runs[n].start,
+                labels + std::size_t (runs[n].y) * width + runs[n].end, run_labels[n]);
+        });
+
+      return result;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   statistics & type conversion implementation
+  // **************************************************************************
+
+  namespace {
+
+    // floating-point values are processed in interleaved lanes, giving
+    // independent accumulators that the compiler can keep in vector
+    // registers:
+    constexpr int statistics_lanes = 8;
+    constexpr int conversion_block = 64;
+
+    struct PartialStatistics {
+      std::size_t count = 0;
+      double min = std::numeric_limits<double>::infinity();
+      double max = -std::numeric_limits<double>::infinity();
+      double mean = 0.0, sum_of_squares = 0.0;
+
+      // combine with the statistics of another set of values (Chan et al.):
+      void operator+= (const PartialStatistics& other)
+      {
+        if (!other.count)
+          return;
+        const double total = double (count) + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        sum_of_squares += other.sum_of_squares + delta * delta * ( double (count) * other.count / total );
+        count += other.count;
+        min = std::min (min, other.min);
+        max = std::max (max, other.max);
+      }
+    };
+
+
+    // integer types of up to 16 bits: exact sums over fixed-size blocks,
+    // allowing the compiler to vectorise the reductions, with the
+    // statistics of each block then combined in double precision:
+    template <typename T>
+      inline PartialStatistics exact_statistics_of (const T* data, std::size_t size)
+      {
+        constexpr int block = 256;
+        using Square = std::conditional_t<sizeof(T) == 1, unsigned int, unsigned long long>;
+        constexpr int lowest = std::numeric_limits<T>::min();
+
+        PartialStatistics stats;
+        auto add_block = [&] (const T* values, int count) {
+          T min = std::numeric_limits<T>::max(), max = std::numeric_limits<T>::min();
+          unsigned int sum = 0;
+          Square sum2 = 0;
+          // values are offset to be non-negative, so the sums cannot overflow:
+          auto accumulate = [&] (T val) {
+            const unsigned int v = int (val) - lowest;
+            min = val < min ? val : min;
+            max = val > max ? val : max;
+            sum += v;
+            sum2 += Square (v) * v;
+          };
+          if (count == block) {
+            for (int n = 0; n < block; ++n)
+              accumulate (values[n]);
+          }
+          else {
+            for (int n = 0; n < count; ++n)
+              accumulate (values[n]);
+          }
+          PartialStatistics partial;
+          partial.count = count;
+          partial.min = min;
+          partial.max = max;
+          partial.mean = double (sum) / count + lowest;
+          partial.sum_of_squares = double (count * (unsigned long long) (sum2) - (unsigned long long) (sum) * sum) / count;
+          stats += partial;
+        };
+
+        for (std::size_t start = 0; start < size; start += block)
+          add_block (data + start, std::min<std::size_t> (block, size - start));
+        return stats;
+      }
+
+
+
+    template <typename T>
+      inline PartialStatistics statistics_of (const T* data, std::size_t size)
+      {
+        if constexpr (std::is_integral_v<T> && sizeof(T) <= 2)
+          return exact_statistics_of (data, size);
+        else {
+          // sums are taken relative to a value close to the mean, to
+          // preserve precision in the sum of squares:
+          double reference = 0.0;
+          for (std::size_t n = 0; n < size; ++n) {
+            if (data[n] == data[n]) {
+              reference = data[n];
+              break;
+            }
+          }
+
+          // blocks are first summed without checking for NaN, which would
+          // prevent vectorisation, & only summed again with the check if
+          // the result shows they contain NaN:
+          constexpr std::size_t block = 256;
+          T min[statistics_lanes], max[statistics_lanes];
+          double sum[statistics_lanes], sum2[statistics_lanes];
+          std::size_t count = 0;
+          for (int l = 0; l < statistics_lanes; ++l) {
+            min[l] = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+            max[l] = std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+          }
+          double total = 0.0, total2 = 0.0;
+
+          for (std::size_t start = 0; start < size; start += block) {
+            const std::size_t end = std::min (start + block, size);
+            for (bool check_nan : { false, true }) {
+              std::fill_n (sum, statistics_lanes, 0.0);
+              std::fill_n (sum2, statistics_lanes, 0.0);
+              std::size_t valid = 0;
+              auto accumulate = [&] (int l, T val) {
+                // comparisons with NaN are false, so these ignore NaN:
+                min[l] = val < min[l] ? val : min[l];
+                max[l] = val > max[l] ? val : max[l];
+                double delta = double (val) - reference;
+                if (check_nan) {
+                  delta = val == val ? delta : 0.0;
+                  valid += val == val;
+                }
+                sum[l] += delta;
+                sum2[l] += delta * delta;
+              };
+              std::size_t n = start;
+              for (; n + statistics_lanes <= end; n += statistics_lanes)
+                for (int l = 0; l < statistics_lanes; ++l)
+                  accumulate (l, data[n+l]);
+              for (; n < end; ++n)
+                accumulate (0, data[n]);
+
+              double block_sum = 0.0, block_sum2 = 0.0;
+              for (int l = 0; l < statistics_lanes; ++l) {
+                block_sum += sum[l];
+                block_sum2 += sum2[l];
+              }
+              if (check_nan || block_sum2 == block_sum2) {
+                total += block_sum;
+                total2 += block_sum2;
+                count += check_nan ? valid : end - start;
+                break;
+              }
+            }
+          }
+
+          PartialStatistics stats;
+          stats.count = count;
+          for (int l = 0; l < statistics_lanes; ++l) {
+            stats.min = std::min (stats.min, double (min[l]));
+            stats.max = std::max (stats.max, double (max[l]));
+          }
+          if (stats.count) {
+            stats.mean = reference + total / stats.count;
+            stats.sum_of_squares = std::max (total2 - total * total / stats.count, 0.0);
+          }
+          return stats;
+        }
+      }
+
+
+
+
+    template <typename TargetType, Rounding rounding>
+      inline TargetType convert_value (double val, double scale, double offset)
+      {
+        val = val * scale + offset;
+        if constexpr (std::is_floating_point_v<TargetType>)
+          return static_cast<TargetType> (val);
+        else {
+          // saturate first: the rounded value is then always in range, &
+          // fits in a 32-bit intermediate unless the target is unsigned
+          // 32-bit:
+          using Intermediate = std::conditional_t<sizeof(TargetType) < 4 || std::is_signed_v<TargetType>, int, long long>;
+          constexpr double lowest = std::numeric_limits<TargetType>::min();
+          constexpr double highest = std::numeric_limits<TargetType>::max();
+          val = val == val ? val : 0.0;
+          val = val < lowest ? lowest : val;
+          val = val > highest ? highest : val;
+          if constexpr (rounding == Rounding::NEAREST)
+            return static_cast<TargetType> (static_cast<Intermediate> (val + ( val < 0.0 ? -0.5 : 0.5 )));
+          else {
+            Intermediate result = static_cast<Intermediate> (val);
+            if constexpr (rounding == Rounding::DOWN)
+              result -= ( result > val );
+            if constexpr (rounding == Rounding::UP)
+              result += ( result < val );
+            return static_cast<TargetType> (result);
+          }
+        }
+      }
+
+
+    // convert values in fixed-size blocks, with the last block overlapping
+    // the previous one - the fixed trip count allows the inner loop to be
+    // vectorised:
+    template <typename TargetType, Rounding rounding, typename SourceType>
+      inline void convert_values (const SourceType* in, std::size_t size, double scale, double offset, TargetType* out)
+      {
+        if (size < std::size_t (conversion_block)) {
+          for (std::size_t n = 0; n < size; ++n)
+            out[n] = convert_value<TargetType,rounding> (in[n], scale, offset);
+          return;
+        }
+        for (std::size_t next = 0; next < size; next += conversion_block) {
+          const std::size_t x0 = std::min (next, size - conversion_block);
+          TargetType result[conversion_block];
+          for (int n = 0; n < conversion_block; ++n)
+            result[n] = convert_value<TargetType,rounding> (in[x0+n], scale, offset);
+          std::copy_n (result, conversion_block, out + x0);
+        }
+      }
+
+  }
+
+
+
+
+  template <typename T>
+    inline ImageStatistics compute_statistics (const Image<T>& image)
+    {
+      static_assert (std::is_arithmetic_v<T> && !std::is_same_v<T,bool>, "compute_statistics() requires a scalar image");
+      const std::size_t size = std::size_t (image.width()) * image.height();
+      const T* data = image.data();
+
+      // statistics of each chunk are combined in order, so that results
+      // do not depend on the number of threads:
+      const int nchunks = number_of_chunks (size);
+      std::vector<PartialStatistics> partial (nchunks);
+      run_in_chunks (nchunks, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t chunk = begin; chunk < end; ++chunk) {
+            const std::size_t first = size*chunk/nchunks, last = size*(chunk+1)/nchunks;
+            partial[chunk] = statistics_of (data + first, last - first);
+          }
+        });
+      PartialStatistics total;
+      for (const auto& stats : partial)
+        total += stats;
+
+      if (!total.count)
+        return { 0, NAN, NAN, NAN, NAN };
+      return { total.count, total.min, total.max, total.mean, total.sum_of_squares / total.count };
+    }
+
+
+
+  template <typename TargetType, typename SourceType>
+    inline Image<TargetType> convert (const Image<SourceType>& image, double scale, double offset, Rounding rounding)
+    {
+      static_assert (std::is_arithmetic_v<SourceType> && !std::is_same_v<SourceType,bool> && sizeof(SourceType) <= 8,
+          "convert() requires a scalar source image");
+      static_assert (std::is_floating_point_v<TargetType> ||
+          ( std::is_integral_v<TargetType> && !std::is_same_v<TargetType,bool> && sizeof(TargetType) <= 4 ),
+          "convert() only supports 8, 16 & 32-bit integer or floating-point target types");
+
+      const std::size_t size = std::size_t (image.width()) * image.height();
+      const SourceType* in = image.data();
+      Image<TargetType> output (image.width(), image.height());
+      TargetType* out = output.data();
+
+      auto run = [&] (auto mode) {
+        constexpr Rounding rounding = decltype(mode)::value;
+        // small integer types are converted via a lookup table of every
+        // possible value, provided the image is large enough to make this
+        // worthwhile:
+        if constexpr (std::is_integral_v<SourceType> && sizeof(SourceType) <= 2) {
+          constexpr int lowest = std::numeric_limits<SourceType>::min();
+          constexpr std::size_t table_size = std::size_t (1) << (8*sizeof(SourceType));
+          if (size >= 4*table_size) {
+            std::vector<SourceType> values (table_size);
+            std::iota (values.begin(), values.end(), std::numeric_limits<SourceType>::min());
+            std::vector<TargetType> table (table_size);
+            convert_values<TargetType,rounding> (values.data(), table_size, scale, offset, table.data());
+            run_in_chunks (size, number_of_chunks (size), [&] (int, std::size_t begin, std::size_t end) {
+                for (std::size_t n = begin; n < end; ++n)
+                  out[n] = table[int (in[n]) - lowest];
+              });
+            return;
+          }
+        }
+        run_in_chunks (size, number_of_chunks (size), [&] (int, std::size_t begin, std::size_t end) {
+            convert_values<TargetType,rounding> (in + begin, end - begin, scale, offset, out + begin);
+          });
+      };
+      switch (rounding) {
+        case Rounding::NEAREST: run (std::integral_constant<Rounding,Rounding::NEAREST>()); break;
+        case Rounding::TOWARD_ZERO: run (std::integral_constant<Rounding,Rounding::TOWARD_ZERO>()); break;
+        case Rounding::DOWN: run (std::integral_constant<Rounding,Rounding::DOWN>()); break;
+        case Rounding::UP: run (std::integral_constant<Rounding,Rounding::UP>()); break;
+      }
+      return output;
+    }
+
+
+
+  template <typename TargetType, typename SourceType>
+    inline Image<TargetType> rescale (const Image<SourceType>& image, double min, double max)
+    {
+      const auto statistics = compute_statistics (image);
+      const double range = statistics.max - statistics.min;
+      const double scale = range > 0.0 ? ( max - min ) / range : 0.0;
+      return convert<TargetType> (image, scale, range > 0.0 ? min - statistics.min * scale : min);
+    }
+
+
+
+  template <typename TargetType, typename SourceType>
+    inline Image<TargetType> rescale (const Image<SourceType>& image)
+    {
+      if constexpr (std::is_floating_point_v<TargetType>)
+        return rescale<TargetType> (image, 0.0, 1.0);
+      else
+        return rescale<TargetType> (image, std::numeric_limits<TargetType>::min(), std::numeric_limits<TargetType>::max());
+    }
+
+
+
+  template <typename SourceType, typename TargetType>
+    inline Image<TargetType> convert_image_to_unsigned_short (const Image<SourceType>& input_image)
+    {
+      return rescale<TargetType> (input_image);
+    }
+
+
+
+
+
+  // **************************************************************************
+  //                   run-length encoding implementation
+  // **************************************************************************
+
+  namespace {
+
+    // index of the first value in [begin, end) differing from data[begin].
+    // Integer types are compared 32 bytes at a time, as 4 64-bit words,
+    // locating the first differing value from the trailing zero bits of the
+    // difference. Floating-point values are compared individually, so that
+    // run_length_encode() matches the semantics of operator==:
+    template <typename T>
+      inline std::size_t find_run_end (const T* data, std::size_t begin, std::size_t end)
+      {
+        const T value = data[begin];
+        std::size_t n = begin + 1;
+        if constexpr (std::is_integral_v<T> && sizeof(T) <= 8) {
+          // short runs are common in noisy images, & quicker to check directly:
+          if (n < end && data[n] != value)
+            return n;
+          constexpr std::size_t per_word = 8 / sizeof(T);
+          T pattern_values[per_word];
+          std::fill_n (pattern_values, per_word, value);
+          std::uint64_t pattern;
+          std::memcpy (&pattern, pattern_values, 8);
+
+          while (n + 4*per_word <= end) {
+            std::uint64_t words[4];
+            std::memcpy (words, data + n, 32);
+            for (auto& word : words)
+              word ^= pattern;
+            if (!( words[0] | words[1] | words[2] | words[3] )) {
+              n += 4*per_word;
+              continue;
+            }
+            for (int w = 0; w < 4; ++w) {
+              if (words[w]) {
+                const int bit = std::endian::native == std::endian::little ?
+                  std::countr_zero (words[w]) : std::countl_zero (words[w]);
+                return n + w*per_word + bit / (8*sizeof(T));
+              }
+            }
+          }
+        }
+        while (n < end && data[n] == value)
+          ++n;
+        return n;
+      }
+
+
+
+    template <typename T>
+      inline void encode_runs (const T* data, std::size_t begin, std::size_t end, std::vector<std::pair<T, int>>& runs)
+      {
+        constexpr std::size_t max_run = std::numeric_limits<int>::max();
+        for (std::size_t n = begin; n < end; ) {
+          const std::size_t next = find_run_end (data, n, std::min (end, n + max_run));
+          runs.emplace_back (data[n], static_cast<int> (next - n));
+          n = next;
+        }
+      }
+
+
+
+    constexpr char rle_magic[4] = { 'T', 'G', 'R', 'L' };
+    constexpr int rle_version = 1;
+    constexpr std::size_t rle_header_size = 16;
+
+    // pixel type code: high nibble gives the kind (0: unsigned, 1: signed,
+    // 2: floating-point), low nibble the size in bytes:
+    template <typename T>
+      constexpr std::uint8_t rle_pixel_code ()
+      {
+        static_assert (std::is_arithmetic_v<T> && !std::is_same_v<T,bool> && sizeof(T) <= 8,
+            "run-length encoded files require scalar pixel types");
+        return ( std::is_floating_point_v<T> ? 0x20 : std::is_signed_v<T> ? 0x10 : 0x00 ) | sizeof(T);
+      }
+
+    inline std::string rle_pixel_name (std::uint8_t code)
+    {
+      const int kind = code >> 4, size = code & 0x0F;
+      if (kind > 2 || !std::has_single_bit (unsigned (size)) || size > 8 || ( kind == 2 && size < 4 ))
+        throw std::runtime_error ("unrecognised pixel type in RLE file");
+      return std::format ("{}{}", kind == 0 ? "uint" : kind == 1 ? "int" : "float", 8*size);
+    }
+
+
+
+    // values are stored little-endian, whatever the native byte order:
+    template <typename T>
+      inline void put_value (std::vector<char>& out, T val)
+      {
+        char bytes[sizeof(T)];
+        std::memcpy (bytes, &val, sizeof(T));
+        if constexpr (std::endian::native == std::endian::big)
+          std::reverse (bytes, bytes + sizeof(T));
+        out.insert (out.end(), bytes, bytes + sizeof(T));
+      }
+
+    template <typename T>
+      inline T get_value (const char*& p, const char* end)
+      {
+        if (end - p < static_cast<std::ptrdiff_t> (sizeof(T)))
+          throw std::runtime_error ("RLE file is truncated");
+        char bytes[sizeof(T)];
+        std::memcpy (bytes, p, sizeof(T));
+        if constexpr (std::endian::native == std::endian::big)
+          std::reverse (bytes, bytes + sizeof(T));
+        p += sizeof(T);
+        T val;
+        std::memcpy (&val, bytes, sizeof(T));
+        return val;
+      }
+
+    // LEB128 varint: 7 bits per byte, least significant first, with the
+    // top bit set on all but the last byte:
+    inline void put_varint (std::vector<char>& out, std::uint64_t val)
+    {
+      while (val >= 0x80) {
+        out.push_back (static_cast<char> (val | 0x80));
+        val >>= 7;
+      }
+      out.push_back (static_cast<char> (val));
+    }
+
+    inline std::uint64_t get_varint (const char*& p, const char* end)
+    {
+      std::uint64_t val = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end)
+          throw std::runtime_error ("RLE file is truncated");
+        const std::uint8_t byte = *p++;
+        val |= std::uint64_t (byte & 0x7F) << shift;
+        if (!( byte & 0x80 ))
+          return val;
+      }
+      throw std::runtime_error ("invalid run length in RLE file");
+    }
+
+
+
+    inline std::vector<char> read_file (const std::string& filename)
+    {
+      std::ifstream in (filename, std::ios::binary | std::ios::ate);
+      if (!in)
+        throw std::runtime_error ("Failed to open file for reading");
+      const std::streamsize size = in.tellg();
+      std::vector<char> buffer (size);
+      in.seekg (0);
+      if (!in.read (buffer.data(), size))
+        throw std::runtime_error ("Failed to read file");
+      return buffer;
+    }
+
+    inline void write_file (const std::string& filename, const std::vector<char>& buffer)
+    {
+      std::ofstream out (filename, std::ios::binary);
+      if (!out)
+        throw std::runtime_error ("Failed to open file for writing");
+      if (!out.write (buffer.data(), buffer.size()))
+        throw std::runtime_error ("Failed to write file");
+    }
+
+
+
+    // pass each run to add_run (value, length), splitting runs at the end of
+    // each row, and calling end_row() once each row is complete:
+    template <typename T, class AddRun, class EndRow>
+      inline void for_each_row_run (const std::vector<std::pair<T, int>>& encoded, int width, int height,
+          AddRun&& add_run, EndRow&& end_row)
+      {
+        if (width < 0 || height < 0)
+          throw std::invalid_argument ("invalid image dimensions");
+        int rows = 0, remaining = width;
+        for (const auto& [ value, count ] : encoded) {
+          if (count <= 0)
+            throw std::invalid_argument ("invalid run length");
+          for (int left = count; left > 0; ) {
+            if (rows >= height)
+              throw std::invalid_argument ("runs exceed the image dimensions");
+            const int length = std::min (left, remaining);
+            add_run (value, length);
+            left -= length;
+            remaining -= length;
+            if (!remaining) {
+              end_row();
+              ++rows;
+              remaining = width;
+            }
+          }
+        }
+        if (width == 0)
+          for (; rows < height; ++rows)
+            end_row();
+        if (rows != height)
+          throw std::invalid_argument ("runs do not cover the image dimensions");
+      }
+
+
+
+    inline bool is_rle_file (const std::vector<char>& buffer)
+    {
+      return buffer.size() >= sizeof(rle_magic) && std::equal (rle_magic, rle_magic + sizeof(rle_magic), buffer.begin());
+    }
+
+    // contents of an RLE file: header, & the location of the runs of
+    // each row within the buffer:
+    struct RLEFileContents {
+      RLEFileInfo info;
+      std::uint8_t pixel_code;
+      std::vector<std::size_t> row_offsets;
+    };
+
+    inline void parse_rle_header (const std::vector<char>& buffer, RLEFileContents& contents)
+    {
+      if (!is_rle_file (buffer))
+        throw std::runtime_error ("not an RLE file");
+      const char* p = buffer.data() + sizeof(rle_magic);
+      const char* end = buffer.data() + buffer.size();
+      contents.info.version = get_value<std::uint8_t> (p, end);
+      if (contents.info.version != rle_version)
+        throw std::runtime_error (std::format ("unsupported RLE file version {}", contents.info.version));
+      contents.pixel_code = get_value<std::uint8_t> (p, end);
+      contents.info.pixel_type = rle_pixel_name (contents.pixel_code);
+      get_value<std::uint16_t> (p, end);
+      const std::uint32_t width = get_value<std::uint32_t> (p, end);
+      const std::uint32_t height = get_value<std::uint32_t> (p, end);
+      // Image holds its pixels in a single int-indexed buffer, so the number
+      // of pixels must fit in an int as well as each dimension:
+      constexpr std::uint32_t max_dim = std::numeric_limits<int>::max();
+      if (width > max_dim || height > max_dim || std::uint64_t (width) * height > max_dim)
+        throw std::runtime_error ("invalid image dimensions in RLE file");
+      contents.info.width = width;
+      contents.info.height = height;
+    }
+
+    inline RLEFileContents parse_rle_file (const std::vector<char>& buffer)
+    {
+      RLEFileContents contents;
+      parse_rle_header (buffer, contents);
+      const char* p = buffer.data() + rle_header_size;
+      const char* end = buffer.data() + buffer.size();
+      const int height = contents.info.height;
+
+      // row index holds the size of each row, giving the offset of each;
+      // each entry takes at least one byte, so the index must fit in the
+      // buffer before anything is allocated for it:
+      if (std::size_t (height) > buffer.size() - rle_header_size)
+        throw std::runtime_error ("RLE file is truncated");
+      contents.row_offsets.resize (std::size_t (height) + 1);
+      std::vector<std::uint64_t> row_sizes (height);
+      for (auto& size : row_sizes)
+        size = get_varint (p, end);
+      std::size_t offset = p - buffer.data();
+      for (int y = 0; y < height; ++y) {
+        contents.row_offsets[y] = offset;
+        if (row_sizes[y] > buffer.size() - offset)
+          throw std::runtime_error ("RLE file is truncated");
+        offset += row_sizes[y];
+      }
+      contents.row_offsets[height] = offset;
+      return contents;
+    }
+
+    template <typename T>
+      inline void check_rle_pixel_type (const RLEFileContents& contents)
+      {
+        if (contents.pixel_code != rle_pixel_code<T>())
+          throw std::runtime_error (std::format ("RLE file holds {} pixels, not {}",
+                contents.info.pixel_type, rle_pixel_name (rle_pixel_code<T>())));
+      }
+
+
+  }
+
+
+
+
+  template <typename T>
+    inline std::vector<std::pair<T, int>> run_length_encode (const Image<T>& image)
+    {
+      const std::size_t size = std::size_t (image.width()) * image.height();
+      const T* data = image.data();
+
+      // each band of the image is encoded separately, then concatenated,
+      // merging runs that continue across band boundaries:
+      const int nchunks = number_of_chunks (size);
+      std::vector<std::vector<std::pair<T, int>>> bands (nchunks);
+      run_in_chunks (nchunks, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t chunk = begin; chunk < end; ++chunk)
+            encode_runs (data, size*chunk/nchunks, size*(chunk+1)/nchunks, bands[chunk]);
+        });
+      if (nchunks == 1)
+        return std::move (bands[0]);
+
+      std::size_t total = 0;
+      for (const auto& band : bands)
+        total += band.size();
+      std::vector<std::pair<T, int>> encoded;
+      encoded.reserve (total);
+      for (const auto& band : bands) {
+        auto first = band.begin();
+        if (first != band.end() && !encoded.empty() && encoded.back().first == first->first &&
+            encoded.back().second <= std::numeric_limits<int>::max() - first->second) {
+          encoded.back().second += first->second;
+          ++first;
+        }
+        encoded.insert (encoded.end(), first, band.end());
+      }
+      return encoded;
+    }
+
+
+
+
+  template <typename T>
+    inline Image<T> run_length_decode (const std::vector<std::pair<T, int>>& encoded, int width, int height)
+    {
+      Image<T> image (width, height);
+      const std::size_t size = std::size_t (width) * height;
+      T* data = image.data();
+
+      // offset of the start of each run, so that each band of the image can
+      // locate its first run:
+      std::vector<std::size_t> offsets (encoded.size() + 1);
+      offsets[0] = 0;
+      for (std::size_t n = 0; n < encoded.size(); ++n)
+        offsets[n+1] = offsets[n] + std::max (encoded[n].second, 0);
+
+      run_in_chunks (size, number_of_chunks (size), [&] (int, std::size_t begin, std::size_t end) {
+          std::size_t run = std::upper_bound (offsets.begin(), offsets.end(), begin) - offsets.begin() - 1;
+          for (std::size_t n = begin; n < end && run < encoded.size(); ++run) {
+            const std::size_t stop = std::min (offsets[run+1], end);
+            std::fill_n (data + n, stop - n, encoded[run].first);
+            n = stop;
+          }
+        });
+      return image;
+    }
+
+
+
+
+
+  inline RLEFileInfo read_rle_file_info (const std::string& filename)
+  {
+    std::ifstream in (filename, std::ios::binary);
+    if (!in)
+      throw std::runtime_error ("Failed to open file for reading");
+    std::vector<char> header (rle_header_size);
+    in.read (header.data(), header.size());
+    header.resize (in.gcount());
+    RLEFileContents contents;
+    parse_rle_header (header, contents);
+    return contents.info;
+  }
+
+
+
+
+  template <typename T>
+    inline void save_encoded_to_file (const std::vector<std::pair<T, int>>& encoded, int width, int height, const std::string& filename)
+    {
+      // runs are split at the end of each row, so that rows can be located
+      // using the row index:
+      std::vector<char> runs;
+      runs.reserve (encoded.size() * ( sizeof(T) + 1 ));
+      std::vector<std::uint64_t> row_sizes;
+      row_sizes.reserve (height);
+      std::size_t row_start = 0;
+      for_each_row_run (encoded, width, height,
+          [&] (const T& value, int length) {
+            put_value (runs, value);
+            put_varint (runs, length - 1);
+          },
+          [&] () {
+            row_sizes.push_back (runs.size() - row_start);
+            row_start = runs.size();
+          });
+
+      std::vector<char> buffer (rle_magic, rle_magic + sizeof(rle_magic));
+      buffer.reserve (rle_header_size + 2*row_sizes.size() + runs.size());
+      put_value<std::uint8_t> (buffer, rle_version);
+      put_value<std::uint8_t> (buffer, rle_pixel_code<T>());
+      put_value<std::uint16_t> (buffer, 0);
+      put_value<std::uint32_t> (buffer, width);
+      put_value<std::uint32_t> (buffer, height);
+      for (const auto size : row_sizes)
+        put_varint (buffer, size);
+      buffer.insert (buffer.end(), runs.begin(), runs.end());
+      write_file (filename, buffer);
+    }
+
+
+
+
+  template <typename T>
+    inline void save_encoded_to_file (const std::vector<std::pair<T, int>>& encoded, const std::string& filename)
+    {
+      std::vector<char> buffer;
+      buffer.reserve (encoded.size() * ( sizeof(T) + sizeof(int) ));
+      for (const auto& [ value, count ] : encoded) {
+        const char* v = reinterpret_cast<const char*> (&value);
+        const char* c = reinterpret_cast<const char*> (&count);
+        buffer.insert (buffer.end(), v, v + sizeof(T));
+        buffer.insert (buffer.end(), c, c + sizeof(int));
+      }
+      write_file (filename, buffer);
+    }
+
+
+
+
+  template <typename T>
+    inline std::vector<std::pair<T, int>> load_encoded_from_file (const std::string& filename)
+    {
+      const auto buffer = read_file (filename);
+      std::vector<std::pair<T, int>> encoded;
+
+      if (!is_rle_file (buffer)) {
+        // legacy format: native (pixel, int) pairs, with no header:
+        const std::size_t record = sizeof(T) + sizeof(int);
+        encoded.resize (buffer.size() / record);
+        for (std::size_t n = 0; n < encoded.size(); ++n) {
+          std::memcpy (&encoded[n].first, buffer.data() + n*record, sizeof(T));
+          std::memcpy (&encoded[n].second, buffer.data() + n*record + sizeof(T), sizeof(int));
+        }
+        return encoded;
+      }
+
+      const auto contents = parse_rle_file (buffer);
+      check_rle_pixel_type<T> (contents);
+      const char* p = buffer.data() + contents.row_offsets.front();
+      const char* end = buffer.data() + contents.row_offsets.back();
+      encoded.reserve (( end - p ) / ( sizeof(T) + 1 ));
+      while (p < end) {
+        const T value = get_value<T> (p, end);
+        const std::uint64_t length = get_varint (p, end) + 1;
+        if (length > std::uint64_t (contents.info.width))
+          throw std::runtime_error ("invalid run length in RLE file");
+        encoded.emplace_back (value, static_cast<int> (length));
+      }
+      return encoded;
+    }
+
+
+
+
+  template <typename T>
+    inline Image<T> load_rle (const std::string& filename)
+    {
+      const auto buffer = read_file (filename);
+      const auto contents = parse_rle_file (buffer);
+      check_rle_pixel_type<T> (contents);
+
+      // rows are located using the row index, so bands of rows can be
+      // decoded in parallel:
+      const int width = contents.info.width;
+      Image<T> image (width, contents.info.height);
+      run_in_chunks (image.height(), number_of_chunks (std::size_t (width) * image.height()), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t y = begin; y < end; ++y) {
+            const char* p = buffer.data() + contents.row_offsets[y];
+            const char* row_end = buffer.data() + contents.row_offsets[y+1];
+            T* out = image.data() + y*width;
+            int x = 0;
+            while (p < row_end) {
+              const T value = get_value<T> (p, row_end);
+              const std::uint64_t length = get_varint (p, row_end) + 1;
+              if (length > std::uint64_t (width - x))
+                throw std::runtime_error ("invalid run length in RLE file");
+              std::fill_n (out + x, length, value);
+              x += length;
+            }
+            if (x != width)
+              throw std::runtime_error ("RLE file row does not match image width");
+          }
+        });
+      return image;
+    }
+
+
+
+
+
+  // **************************************************************************
+  //                   RLEImage implementation
+  // **************************************************************************
+
+  template <typename T>
+    inline RLEImage<T>::RLEImage (const Image<T>& image) :
+      x_dim (image.width()), y_dim (image.height())
+    {
+      // each band of rows is encoded separately, then concatenated:
+      const int nchunks = number_of_chunks (std::size_t (x_dim) * y_dim);
+      std::vector<std::vector<Run>> bands (nchunks);
+      std::vector<std::size_t> row_sizes (y_dim);
+      run_in_chunks (nchunks, nchunks, [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t chunk = begin; chunk < end; ++chunk) {
+            for (int y = y_dim*chunk/nchunks; y < int (y_dim*(chunk+1)/nchunks); ++y) {
+              const std::size_t before = bands[chunk].size();
+              encode_runs (image.data() + std::size_t (y) * x_dim, 0, x_dim, bands[chunk]);
+              row_sizes[y] = bands[chunk].size() - before;
+            }
+          }
+        });
+
+      std::size_t total = 0;
+      for (const auto& band : bands)
+        total += band.size();
+      all_runs.reserve (total);
+      for (const auto& band : bands)
+        all_runs.insert (all_runs.end(), band.begin(), band.end());
+      row_start.resize (y_dim + 1);
+      row_start[0] = 0;
+      for (int y = 0; y < y_dim; ++y)
+        row_start[y+1] = row_start[y] + row_sizes[y];
+      index_runs();
+    }
+
+
+
+  template <typename T>
+    inline RLEImage<T>::RLEImage (const std::vector<Run>& encoded, int width, int height) :
+      x_dim (width), y_dim (height)
+    {
+      all_runs.reserve (encoded.size() + height);
+      row_start.reserve (height + 1);
+      row_start.push_back (0);
+      for_each_row_run (encoded, width, height,
+          [&] (const T& value, int length) { all_runs.emplace_back (value, length); },
+          [&] () { row_start.push_back (all_runs.size()); });
+      index_runs();
+    }
+
+
+
+  template <typename T>
+    inline void RLEImage<T>::index_runs ()
+    {
+      // position of the end of each run within its row, for random access:
+      run_ends.resize (all_runs.size());
+      for (int y = 0; y < y_dim; ++y) {
+        int x = 0;
+        for (std::size_t n = row_start[y]; n < row_start[y+1]; ++n)
+          run_ends[n] = x += all_runs[n].second;
+      }
+    }
+
+
+
+  template <typename T>
+    inline T RLEImage<T>::operator() (int x, int y) const
+    {
+      const auto first = run_ends.begin() + row_start[y];
+      const auto last = run_ends.begin() + row_start[y+1];
+      return all_runs[std::upper_bound (first, last, x) - run_ends.begin()].first;
+    }
+
+
+
+  template <typename T>
+    inline std::span<const typename RLEImage<T>::Run> RLEImage<T>::row_runs (int y) const
+    {
+      return { all_runs.data() + row_start[y], all_runs.data() + row_start[y+1] };
+    }
+
+
+
+  template <typename T>
+    inline RLEImage<T> RLEImage<T>::crop (int x, int y, int width, int height) const
+    {
+      if (x < 0 || y < 0 || width < 0 || height < 0 || x + width > x_dim || y + height > y_dim)
+        throw std::invalid_argument ("crop region extends beyond the image");
+
+      RLEImage<T> cropped;
+      cropped.x_dim = width;
+      cropped.y_dim = height;
+      cropped.row_start.reserve (height + 1);
+      cropped.row_start.push_back (0);
+      for (int row = y; row < y + height; ++row) {
+        // first run extending past x, clipped to the region:
+        const auto first = run_ends.begin() + row_start[row];
+        const auto last = run_ends.begin() + row_start[row+1];
+        for (auto end = std::upper_bound (first, last, x); end != last && width; ++end) {
+          const std::size_t n = end - run_ends.begin();
+          const int run_begin = std::max (*end - all_runs[n].second, x);
+          const int run_end = std::min (*end, x + width);
+          cropped.all_runs.emplace_back (all_runs[n].first, run_end - run_begin);
+          if (run_end == x + width)
+            break;
+        }
+        cropped.row_start.push_back (cropped.all_runs.size());
+      }
+      cropped.index_runs();
+      return cropped;
+    }
+
+
+
+  template <typename T>
+    inline Image<T> RLEImage<T>::decode () const
+    {
+      Image<T> image (x_dim, y_dim);
+      run_in_chunks (y_dim, number_of_chunks (std::size_t (x_dim) * y_dim), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t y = begin; y < end; ++y) {
+            T* out = image.data() + y*x_dim;
+            for (const auto& [ value, length ] : row_runs (y)) {
+              std::fill_n (out, length, value);
+              out += length;
+            }
+          }
+        });
+      return image;
+    }
+
+
+
+  template <typename T>
+    inline RLEImage<T> load_rle_image (const std::string& filename)
+    {
+      const auto buffer = read_file (filename);
+      const auto contents = parse_rle_file (buffer);
+      check_rle_pixel_type<T> (contents);
+
+      RLEImage<T> image;
+      image.x_dim = contents.info.width;
+      image.y_dim = contents.info.height;
+      image.row_start.reserve (image.y_dim + 1);
+      image.row_start.push_back (0);
+      for (int y = 0; y < image.y_dim; ++y) {
+        const char* p = buffer.data() + contents.row_offsets[y];
+        const char* end = buffer.data() + contents.row_offsets[y+1];
+        int x = 0;
+        while (p < end) {
+          const T value = get_value<T> (p, end);
+          const std::uint64_t length = get_varint (p, end) + 1;
+          if (length > std::uint64_t (image.x_dim - x))
+            throw std::runtime_error ("invalid run length in RLE file");
+          image.all_runs.emplace_back (value, static_cast<int> (length));
+          x += length;
+        }
+        if (x != image.x_dim)
+          throw std::runtime_error ("RLE file row does not match image width");
+        image.row_start.push_back (image.all_runs.size());
+      }
+      image.index_runs();
+      return image;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   lossless codec implementation
+  // **************************************************************************
+
+  namespace {
+
+    constexpr char codec_magic[4] = { 'T', 'G', 'T', 'C' };
+    constexpr int codec_version = 1;
+    constexpr std::size_t codec_header_size = 20;
+    constexpr int rice_block = 16;
+    constexpr int rice_escape = 24;    // unary prefixes this long are followed by the raw value
+    constexpr int zero_block = 31;     // Rice parameter flagging a block of zero residuals
+
+    enum Predictor : std::uint8_t { PREDICT_NONE, PREDICT_LEFT, PREDICT_UP, PREDICT_PAETH, PREDICT_MED, NUM_PREDICTORS };
+
+    // prediction from the left, upper & upper-left neighbours:
+    inline long long predict (int predictor, long long w, long long n, long long nw)
+    {
+      switch (predictor) {
+        case PREDICT_LEFT: return w;
+        case PREDICT_UP: return n;
+        case PREDICT_PAETH: {
+          const long long p = w + n - nw;
+          const long long pa = std::abs (p - w), pb = std::abs (p - n), pc = std::abs (p - nw);
+          return pa <= pb && pa <= pc ? w : ( pb <= pc ? n : nw );
+        }
+        case PREDICT_MED:
+          if (nw >= std::max (w, n)) return std::min (w, n);
+          if (nw <= std::min (w, n)) return std::max (w, n);
+          return w + n - nw;
+        default: return 0;
+      }
+    }
+
+    // apply func (x, y, prediction) over a tile in raster order, where
+    // value (x, y) gives the pixels already visited. Neighbours outside the
+    // tile are replaced by those available, so that tiles are independent:
+    template <class Value, class Func>
+      inline void for_each_prediction (int predictor, int width, int height, Value&& value, Func&& func)
+      {
+        for (int y = 0; y < height; ++y) {
+          for (int x = 0; x < width; ++x) {
+            long long w, n, nw;
+            if (y == 0) {
+              w = n = nw = x ? value (x-1, y) : 0;
+            }
+            else if (x == 0) {
+              w = n = nw = value (x, y-1);
+            }
+            else {
+              w = value (x-1, y);
+              n = value (x, y-1);
+              nw = value (x-1, y-1);
+            }
+            func (x, y, predict (predictor, w, n, nw));
+          }
+        }
+      }
+
+    // map signed residuals (modulo 2^bits) onto unsigned values, with small
+    // magnitudes mapping to small values:
+    template <typename T>
+      inline std::uint32_t zigzag (T value, long long prediction)
+      {
+        using U = std::make_unsigned_t<T>;
+        using S = std::make_signed_t<T>;
+        const S residual = static_cast<S> (static_cast<U> (static_cast<U> (value) - static_cast<U> (prediction)));
+        return static_cast<U> (static_cast<U> (static_cast<U> (residual) << 1) ^ static_cast<U> (residual >> (8*sizeof(T)-1)));
+      }
+
+    template <typename T>
+      inline T unzigzag (std::uint32_t code, long long prediction)
+      {
+        using U = std::make_unsigned_t<T>;
+        const U residual = static_cast<U> (( code >> 1 ) ^ ( 0U - ( code & 1U ) ));
+        return static_cast<T> (static_cast<U> (static_cast<U> (prediction) + residual));
+      }
+
+
+
+    class BitWriter {
+      public:
+        BitWriter (std::vector<char>& output) : out (output) { }
+        ~BitWriter () { if (nbits) out.push_back (static_cast<char> (bits)); }
+
+        // write the lowest `count` bits of val (count <= 32):
+        void put (std::uint64_t val, int count) {
+          bits |= ( val & ( ( std::uint64_t (1) << count ) - 1 ) ) << nbits;
+          nbits += count;
+          while (nbits >= 8) {
+            out.push_back (static_cast<char> (bits));
+            bits >>= 8;
+            nbits -= 8;
+          }
+        }
+
+      private:
+        std::vector<char>& out;
+        std::uint64_t bits = 0;
+        int nbits = 0;
+    };
+
+    // reads past the end of the data return zero bits:
+    class BitReader {
+      public:
+        BitReader (const char* begin, const char* end) :
+          p (reinterpret_cast<const unsigned char*> (begin)),
+          end (reinterpret_cast<const unsigned char*> (end)) { }
+
+        std::uint32_t get (int count) {
+          refill();
+          const std::uint32_t val = bits & ( ( std::uint64_t (1) << count ) - 1 );
+          bits >>= count;
+          nbits -= count;
+          return val;
+        }
+
+        // number of consecutive 1 bits, up to limit, consuming the
+        // terminating zero if the limit is not reached:
+        int get_unary (int limit) {
+          refill();
+          const int ones = std::min (std::countr_one (bits), limit);
+          const int consumed = ones < limit ? ones + 1 : limit;
+          bits >>= consumed;
+          nbits -= consumed;
+          return ones;
+        }
+
+      private:
+        const unsigned char* p, *end;
+        std::uint64_t bits = 0;
+        int nbits = 0;
+
+        void refill () {
+          while (nbits <= 56) {
+            bits |= std::uint64_t (p < end ? *p++ : 0) << nbits;
+            nbits += 8;
+          }
+        }
+    };
+
+
+
+    // Rice code a block of residuals, choosing the parameter k that gives
+    // the shortest code from those around log2 of the mean:
+    inline void rice_encode_block (BitWriter& out, const std::uint32_t* codes, int count, int bits)
+    {
+      std::uint64_t sum = 0;
+      for (int n = 0; n < count; ++n)
+        sum += codes[n];
+      if (!sum) {
+        out.put (zero_block, 5);
+        return;
+      }
+      auto cost = [&] (int k) {
+        std::uint64_t total = 0;
+        for (int n = 0; n < count; ++n) {
+          const std::uint64_t q = codes[n] >> k;
+          total += q < rice_escape ? q + 1 + k : rice_escape + bits;
+        }
+        return total;
+      };
+      const int guess = std::bit_width (sum / count);
+      int best_k = 0;
+      std::uint64_t best_cost = std::numeric_limits<std::uint64_t>::max();
+      for (int k = std::max (guess-2, 0); k <= std::min (guess, std::min (bits-1, zero_block-1)); ++k) {
+        const auto c = cost (k);
+        if (c < best_cost) {
+          best_cost = c;
+          best_k = k;
+        }
+      }
+
+      out.put (best_k, 5);
+      for (int n = 0; n < count; ++n) {
+        const std::uint32_t q = codes[n] >> best_k;
+        if (q < std::uint32_t (rice_escape)) {
+          out.put (( std::uint64_t (1) << q ) - 1, q + 1);
+          out.put (codes[n], best_k);
+        }
+        else {
+          out.put (( std::uint64_t (1) << rice_escape ) - 1, rice_escape);
+          out.put (codes[n], bits);
+        }
+      }
+    }
+
+    inline void rice_decode_block (BitReader& in, std::uint32_t* codes, int count, int bits)
+    {
+      const int k = in.get (5);
+      if (k == zero_block) {
+        std::fill_n (codes, count, 0U);
+        return;
+      }
+      for (int n = 0; n < count; ++n) {
+        const std::uint32_t q = in.get_unary (rice_escape);
+        codes[n] = q < std::uint32_t (rice_escape) ? ( q << k ) | in.get (k) : in.get (bits);
+      }
+    }
+
+
+
+    template <typename T>
+      inline void encode_rice_tile (const T* data, std::size_t stride, int width, int height, std::vector<char>& out)
+      {
+        auto value = [&] (int x, int y) { return static_cast<long long> (data[y*stride + x]); };
+
+        // choose the predictor giving the smallest residuals:
+        std::vector<std::uint32_t> codes (std::size_t (width) * height), best;
+        std::uint64_t best_total = std::numeric_limits<std::uint64_t>::max();
+        int best_predictor = PREDICT_NONE;
+        for (int predictor = PREDICT_NONE; predictor < NUM_PREDICTORS; ++predictor) {
+          std::uint64_t total = 0;
+          for_each_prediction (predictor, width, height, value, [&] (int x, int y, long long prediction) {
+              const auto code = zigzag (data[y*stride + x], prediction);
+              codes[y*width + x] = code;
+              total += code;
+            });
+          if (total < best_total) {
+            best_total = total;
+            best_predictor = predictor;
+            std::swap (codes, best);
+            codes.resize (best.size());
+          }
+        }
+
+        out.push_back (static_cast<char> (best_predictor));
+        BitWriter bits (out);
+        for (std::size_t n = 0; n < best.size(); n += rice_block)
+          rice_encode_block (bits, best.data() + n, std::min<std::size_t> (rice_block, best.size() - n), 8*sizeof(T));
+      }
+
+
+    // decode a tile into a buffer of size width x height:
+    template <typename T>
+      inline void decode_rice_tile (const char* begin, const char* end, int width, int height, T* out)
+      {
+        if (begin == end)
+          throw std::runtime_error ("compressed tile is empty");
+        const int predictor = static_cast<std::uint8_t> (*begin);
+        if (predictor >= NUM_PREDICTORS)
+          throw std::runtime_error ("invalid predictor in compressed tile");
+
+        std::vector<std::uint32_t> codes (std::size_t (width) * height);
+        BitReader bits (begin + 1, end);
+        for (std::size_t n = 0; n < codes.size(); n += rice_block)
+          rice_decode_block (bits, codes.data() + n, std::min<std::size_t> (rice_block, codes.size() - n), 8*sizeof(T));
+
+        auto value = [&] (int x, int y) { return static_cast<long long> (out[y*width + x]); };
+        for_each_prediction (predictor, width, height, value, [&] (int x, int y, long long prediction) {
+            out[y*width + x] = unzigzag<T> (codes[y*width + x], prediction);
+          });
+      }
+
+  }
+
+
+
+
+
+  template <typename T>
+    inline CompressedImage<T>::CompressedImage (const Image<T>& image, int tile_size) :
+      x_dim (image.width()), y_dim (image.height()), tile (tile_size)
+    {
+      static_assert (std::is_integral_v<T> && !std::is_same_v<T,bool> && sizeof(T) <= 4,
+          "CompressedImage only supports integer pixel types of up to 32 bits");
+      if (tile_size < 1)
+        throw std::invalid_argument ("invalid tile size");
+
+      // tiles are compressed independently & in parallel:
+      const int ntiles = tiles_x() * tiles_y();
+      std::vector<std::vector<char>> tiles (ntiles);
+      run_in_chunks (ntiles, number_of_chunks (std::size_t (x_dim) * y_dim), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t n = begin; n < end; ++n) {
+            const int x = ( n % tiles_x() ) * tile, y = ( n / tiles_x() ) * tile;
+            encode_rice_tile (image.data() + std::size_t (y) * x_dim + x, x_dim,
+                std::min (tile, x_dim - x), std::min (tile, y_dim - y), tiles[n]);
+          }
+        });
+
+      buffer.assign (codec_magic, codec_magic + sizeof(codec_magic));
+      put_value<std::uint8_t> (buffer, codec_version);
+      put_value<std::uint8_t> (buffer, rle_pixel_code<T>());
+      put_value<std::uint16_t> (buffer, 0);
+      put_value<std::uint32_t> (buffer, x_dim);
+      put_value<std::uint32_t> (buffer, y_dim);
+      put_value<std::uint32_t> (buffer, tile);
+      for (const auto& t : tiles)
+        put_varint (buffer, t.size());
+      for (const auto& t : tiles)
+        buffer.insert (buffer.end(), t.begin(), t.end());
+      index_tiles();
+    }
+
+
+
+  template <typename T>
+    inline CompressedImage<T>::CompressedImage (std::vector<char> data) :
+      buffer (std::move (data))
+    {
+      if (buffer.size() < sizeof(codec_magic) || !std::equal (codec_magic, codec_magic + sizeof(codec_magic), buffer.begin()))
+        throw std::runtime_error ("not a compressed image");
+      const char* p = buffer.data() + sizeof(codec_magic);
+      const char* end = buffer.data() + buffer.size();
+      const int version = get_value<std::uint8_t> (p, end);
+      if (version != codec_version)
+        throw std::runtime_error (std::format ("unsupported compressed image version {}", version));
+      const std::uint8_t pixel_code = get_value<std::uint8_t> (p, end);
+      if (pixel_code != rle_pixel_code<T>())
+        throw std::runtime_error (std::format ("compressed image holds {} pixels, not {}",
+              rle_pixel_name (pixel_code), rle_pixel_name (rle_pixel_code<T>())));
+      get_value<std::uint16_t> (p, end);
+      const std::uint32_t width = get_value<std::uint32_t> (p, end);
+      const std::uint32_t height = get_value<std::uint32_t> (p, end);
+      const std::uint32_t tile_size = get_value<std::uint32_t> (p, end);
+      constexpr std::uint32_t max_dim = std::numeric_limits<int>::max();
+      if (width > max_dim || height > max_dim || std::uint64_t (width) * height > max_dim || tile_size < 1 || tile_size > max_dim)
+        throw std::runtime_error ("invalid dimensions in compressed image");
+      x_dim = width;
+      y_dim = height;
+      tile = tile_size;
+      index_tiles();
+    }
+
+
+
+  template <typename T>
+    inline void CompressedImage<T>::index_tiles ()
+    {
+      const char* p = buffer.data() + codec_header_size;
+      const char* end = buffer.data() + buffer.size();
+      const std::size_t ntiles = std::size_t (tiles_x()) * tiles_y();
+      // each entry of the tile index takes at least one byte:
+      if (ntiles > std::size_t (end - p))
+        throw std::runtime_error ("compressed image is truncated");
+      std::vector<std::uint64_t> sizes (ntiles);
+      for (auto& size : sizes)
+        size = get_varint (p, end);
+
+      // each tile holds its predictor, then at least 5 bits (the Rice
+      // parameter) per block of residuals, which bounds the memory needed
+      // to decode it by the size of the data:
+      auto min_tile_size = [&] (std::size_t n) {
+        const int x0 = ( n % tiles_x() ) * tile, y0 = ( n / tiles_x() ) * tile;
+        const std::size_t pixels = std::size_t (std::min (tile, x_dim - x0)) * std::min (tile, y_dim - y0);
+        return 1 + ( 5 * (( pixels + rice_block - 1 ) / rice_block) + 7 ) / 8;
+      };
+
+      tile_offsets.resize (ntiles + 1);
+      tile_offsets[0] = p - buffer.data();
+      for (std::size_t n = 0; n < ntiles; ++n) {
+        if (sizes[n] > buffer.size() - tile_offsets[n])
+          throw std::runtime_error ("compressed image is truncated");
+        if (sizes[n] < min_tile_size (n))
+          throw std::runtime_error ("compressed tile is too small for its dimensions");
+        tile_offsets[n+1] = tile_offsets[n] + sizes[n];
+      }
+    }
+
+
+
+  // decode the part of tile (tx, ty) that overlaps the region of size
+  // width x height at (x, y), into out, which holds that region:
+  template <typename T>
+    inline void CompressedImage<T>::decode_tile_into (int tx, int ty, T* out, std::size_t stride,
+        int x, int y, int width, int height) const
+    {
+      const int x0 = tx * tile, y0 = ty * tile;
+      const int tile_width = std::min (tile, x_dim - x0), tile_height = std::min (tile, y_dim - y0);
+      std::vector<T> decoded (std::size_t (tile_width) * tile_height);
+      const std::size_t n = std::size_t (ty) * tiles_x() + tx;
+      decode_rice_tile (buffer.data() + tile_offsets[n], buffer.data() + tile_offsets[n+1], tile_width, tile_height, decoded.data());
+
+      const int first_x = std::max (x0, x), last_x = std::min (x0 + tile_width, x + width);
+      const int first_y = std::max (y0, y), last_y = std::min (y0 + tile_height, y + height);
+      for (int row = first_y; row < last_y; ++row)
+        std::copy (decoded.data() + std::size_t (row - y0) * tile_width + ( first_x - x0 ),
+            decoded.data() + std::size_t (row - y0) * tile_width + ( last_x - x0 ),
+            out + std::size_t (row - y) * stride + ( first_x - x ));
+    }
+
+
+
+  template <typename T>
+    inline Image<T> CompressedImage<T>::decode_region (int x, int y, int width, int height) const
+    {
+      if (x < 0 || y < 0 || width < 0 || height < 0 || x + width > x_dim || y + height > y_dim)
+        throw std::invalid_argument ("region extends beyond the image");
+      Image<T> image (width, height);
+      if (!width || !height)
+        return image;
+
+      // only the tiles overlapping the region are decoded, in parallel:
+      const int tx0 = x / tile, tx1 = ( x + width - 1 ) / tile;
+      const int ty0 = y / tile, ty1 = ( y + height - 1 ) / tile;
+      const int ntiles = ( tx1 - tx0 + 1 ) * ( ty1 - ty0 + 1 );
+      run_in_chunks (ntiles, number_of_chunks (std::size_t (width) * height), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t n = begin; n < end; ++n)
+            decode_tile_into (tx0 + n % ( tx1 - tx0 + 1 ), ty0 + n / ( tx1 - tx0 + 1 ),
+                image.data(), width, x, y, width, height);
+        });
+      return image;
+    }
+
+
+
+  template <typename T>
+    inline Image<T> CompressedImage<T>::decode () const
+    {
+      return decode_region (0, 0, x_dim, y_dim);
+    }
+
+
+
+  template <typename T>
+    inline Image<T> CompressedImage<T>::decode_tile (int tx, int ty) const
+    {
+      if (tx < 0 || ty < 0 || tx >= tiles_x() || ty >= tiles_y())
+        throw std::invalid_argument ("tile index out of range");
+      return decode_region (tx * tile, ty * tile, std::min (tile, x_dim - tx*tile), std::min (tile, y_dim - ty*tile));
+    }
+
+
+
+  template <typename T>
+    inline void save_compressed (const CompressedImage<T>& image, const std::string& filename)
+    {
+      write_file (filename, image.bytes());
+    }
+
+
+
+  template <typename T>
+    inline CompressedImage<T> load_compressed (const std::string& filename)
+    {
+      return CompressedImage<T> (read_file (filename));
+    }
+
+
+
+
+  // **************************************************************************
+  //                   polar transform implementation
+  // **************************************************************************
+
+  namespace {
+
+    // bilinear tap for position (x, y) in a grid of width x height
+    // samples, with y wrapping around if periodic; positions more than half
+    // a sample beyond the grid are invalid:
+    template <class Tap>
+      inline Tap make_polar_tap (double x, double y, int width, int height, bool periodic)
+      {
+        constexpr std::uint32_t invalid = std::numeric_limits<std::uint32_t>::max();
+        if (!( x >= -0.5 && x <= width - 0.5 ))
+          return { invalid, invalid, 0, 0 };
+        if (periodic)
+          y -= height * std::floor (y / height);
+        else if (!( y >= -0.5 && y <= height - 0.5 ))
+          return { invalid, invalid, 0, 0 };
+
+        x = std::clamp (x, 0.0, width - 1.0);
+        const int x0 = std::min (static_cast<int> (x), width - 2);
+        int y0, y1;
+        if (periodic) {
+          y0 = std::min (static_cast<int> (y), height - 1);
+          y1 = y0 + 1 < height ? y0 + 1 : 0;
+        }
+        else {
+          y = std::clamp (y, 0.0, height - 1.0);
+          y0 = std::min (static_cast<int> (y), height - 2);
+          y1 = y0 + 1;
+        }
+        return {
+          static_cast<std::uint32_t> (std::size_t (y0) * width + x0),
+          static_cast<std::uint32_t> (std::size_t (y1) * width + x0),
+          static_cast<std::uint16_t> (std::lround (( x - x0 ) * 32768.0)),
+          static_cast<std::uint16_t> (std::lround (( y - y0 ) * 32768.0))
+        };
+      }
+
+
+    // transform for the default geometry of the given size, shared
+    // between calls:
+    inline std::shared_ptr<const PolarTransform> get_polar_transform (int width, int height, int num_angles, int num_radii)
+    {
+      using key_type = std::tuple<int,int,int,int>;
+      static std::map<key_type,std::shared_ptr<const PolarTransform>> cache;
+      static std::mutex mutex;
+      const key_type key (width, height, num_angles, num_radii);
+      std::lock_guard<std::mutex> lock (mutex);
+      if (cache.size() >= 32 && !cache.contains (key))
+        cache.clear();
+      auto& transform = cache[key];
+      if (!transform)
+        transform = std::make_shared<const PolarTransform> (width, height, num_angles, num_radii);
+      return transform;
+    }
+
+  }
+
+
+
+  inline PolarTransform::PolarTransform (int width, int height, int num_angles, int num_radii,
+      double max_radius, double centre_x, double centre_y) :
+    x_dim (width), y_dim (height), n_angles (num_angles),
+    n_radii (num_radii > 0 ? num_radii : std::min (width, height) / 2),
+    r_max (max_radius > 0.0 ? max_radius : n_radii),
+    cx (std::isnan (centre_x) ? width / 2 : centre_x),
+    cy (std::isnan (centre_y) ? height / 2 : centre_y)
+  {
+    if (x_dim < 2 || y_dim < 2 || n_angles < 2 || n_radii < 2)
+      throw std::invalid_argument ("polar transform requires images at least 2 pixels across");
+    if (std::size_t (x_dim) * y_dim >= invalid || std::size_t (n_radii) * n_angles >= invalid)
+      throw std::invalid_argument ("image too large for polar transform");
+
+    const double radius_step = r_max / n_radii;
+    const double angle_step = 2.0 * M_PI / n_angles;
+
+    // polar samples, gathered from the cartesian image:
+    polar_map.resize (std::size_t (n_radii) * n_angles);
+    run_in_chunks (n_angles, number_of_chunks (polar_map.size()), [&] (int, std::size_t begin, std::size_t end) {
+        for (int theta = begin; theta < static_cast<int> (end); ++theta) {
+          const double c = std::cos (theta * angle_step), s = std::sin (theta * angle_step);
+          for (int r = 0; r < n_radii; ++r)
+            polar_map[std::size_t (theta) * n_radii + r] = make_polar_tap<Tap> (
+                cx + r * radius_step * c, cy + r * radius_step * s, x_dim, y_dim, false);
+        }
+      });
+
+    // cartesian pixels, gathered from the polar image:
+    cartesian_map.resize (std::size_t (x_dim) * y_dim);
+    run_in_chunks (y_dim, number_of_chunks (cartesian_map.size()), [&] (int, std::size_t begin, std::size_t end) {
+        for (int y = begin; y < static_cast<int> (end); ++y) {
+          for (int x = 0; x < x_dim; ++x)
+            cartesian_map[std::size_t (y) * x_dim + x] = make_polar_tap<Tap> (
+                std::hypot (x - cx, y - cy) / radius_step, std::atan2 (y - cy, x - cx) / angle_step,
+                n_radii, n_angles, true);
+        }
+      });
+  }
+
+
+
+  template <typename T>
+    inline Image<T> PolarTransform::gather (const Image<T>& source, const std::vector<Tap>& map, int width, int height)
+    {
+      // single precision suffices for 8 & 16-bit pixels:
+      using value_type = std::conditional_t<( sizeof(T) <= 2 && std::is_integral_v<T> ) || std::is_same_v<T,float>, float, double>;
+      constexpr value_type scale = value_type (1) / 32768;
+
+      Image<T> out (width, height);
+      const T* in = source.data();
+      run_in_chunks (height, number_of_chunks (std::size_t (width) * height), [&] (int, std::size_t begin, std::size_t end) {
+          for (std::size_t n = begin * width; n < end * width; ++n) {
+            const Tap& tap = map[n];
+            if (tap.top == invalid) {
+              out.data()[n] = T (0);
+              continue;
+            }
+            const value_type fx = tap.fx * scale, fy = tap.fy * scale;
+            const value_type a = in[tap.top], b = in[tap.top+1];
+            const value_type c = in[tap.bottom], d = in[tap.bottom+1];
+            const value_type upper = a + fx * ( b - a );
+            const value_type lower = c + fx * ( d - c );
+            out.data()[n] = round_to<T> (upper + fy * ( lower - upper ));
+          }
+        });
+      return out;
+    }
+
+
+
+  template <typename T>
+    inline Image<T> PolarTransform::to_polar (const Image<T>& image) const
+    {
+      if (image.width() != x_dim || image.height() != y_dim)
+        throw std::invalid_argument ("image dimensions do not match polar transform");
+      return gather (image, polar_map, n_radii, n_angles);
+    }
+
+
+
+  template <typename T>
+    inline Image<T> PolarTransform::to_cartesian (const Image<T>& polar_image) const
+    {
+      if (polar_image.width() != n_radii || polar_image.height() != n_angles)
+        throw std::invalid_argument ("polar image dimensions do not match polar transform");
+      return gather (polar_image, cartesian_map, x_dim, y_dim);
+    }
+
+
+
+  template <typename T>
+    inline Image<T> cartesian_to_polar (const Image<T>& image, double sigma)
+    {
+      auto polar_image = get_polar_transform (image.width(), image.height(), 360, 0)->to_polar (image);
+      if (sigma <= 0.0)
+        return polar_image;
+      return apply_gaussian_filter (polar_image, 2 * static_cast<int> (std::ceil (2.0 * sigma)) + 1, sigma);
+    }
+
+
+
+  template <typename T>
+    inline Image<T> polar_to_cartesian (const Image<T>& polar_image, int width, int height)
+    {
+      return get_polar_transform (width, height, polar_image.height(), polar_image.width())->to_cartesian (polar_image);
+    }
+
+
+
+
+  // **************************************************************************
+  //                   Rescale implementation
+  // **************************************************************************
+
+  template <class ImageType>
+    inline Rescale<ImageType>::Rescale (const ImageType& image, double minval, double maxval, int cmap_size) :
+      im (image), min (minval), max (maxval), cmap_size (cmap_size) { }
+
+  template <class ImageType>
+    inline int Rescale<ImageType>::width () const { return im.width(); }
+
+  template <class ImageType>
+    inline int Rescale<ImageType>::height () const { return im.height(); }
+
+  template <class ImageType>
+    inline ctype Rescale<ImageType>::operator() (int x, int y) const {
+      double rescaled = cmap_size * (im(x,y) - min) / (max - min);
+      return std::round (std::min (std::max (rescaled, 0.0), cmap_size-1.0));
+    }
+
+  // runs are rescaled in the same way, merging adjacent runs that map to
+  // the same index:
+  template <class ImageType>
+    inline std::vector<std::pair<ctype,int>> Rescale<ImageType>::row_runs (int y) const requires HasRowRuns<ImageType> {
+      std::vector<std::pair<ctype,int>> runs;
+      for (const auto& [ value, count ] : im.row_runs (y)) {
+        double rescaled = cmap_size * (value - min) / (max - min);
+        const ctype index = std::round (std::min (std::max (rescaled, 0.0), cmap_size-1.0));
+        if (!runs.empty() && runs.back().first == index)
+          runs.back().second += count;
+        else
+          runs.emplace_back (index, count);
+      }
+      return runs;
+    }
+
+
+
+  // **************************************************************************
+  //                   magnify implementation
+  // **************************************************************************
+
+  template <class ImageType>
+    inline magnify<ImageType>::magnify (const ImageType& image, int factor) :
+      im (image), factor (factor) { }
+
+  template <class ImageType>
+    inline int magnify<ImageType>::width () const { return im.width() * factor; }
+
+  template <class ImageType>
+    inline int magnify<ImageType>::height () const { return im.height() * factor; }
+
+  template <class ImageType>
+    inline decltype(std::declval<const ImageType>()(0,0)) magnify<ImageType>::operator() (int x, int y) const {
+      return im (x/factor, y/factor);
+    }
+
+
+
+
+  // **************************************************************************
+  //                   wrap_labels implementation
+  // **************************************************************************
+
+  template <class ImageType>
+    inline wrap_labels<ImageType>::wrap_labels (const ImageType& image, int cmap_size) :
+      im (image), cmap_size (cmap_size) { }
+
+  template <class ImageType>
+    inline int wrap_labels<ImageType>::width () const { return im.width(); }
+
+  template <class ImageType>
+    inline int wrap_labels<ImageType>::height () const { return im.height(); }
+
+  template <class ImageType>
+    inline int wrap_labels<ImageType>::operator() (int x, int y) const {
+      const long long label = im (x, y);
+      return label > 0 ? 1 + ( label - 1 ) % ( cmap_size - 1 ) : 0;
+    }
+
+
+
+
+  // **************************************************************************
+  //                   montage implementation
+  // **************************************************************************
+
+  template <class ImageType>
+    inline auto montage (const std::vector<ImageType>& images, int downsample, int columns, int spacing)
+      -> Image<std::remove_cvref_t<decltype(std::declval<const ImageType&>()(0,0))>>
+    {
+      using T = std::remove_cvref_t<decltype(std::declval<const ImageType&>()(0,0))>;
+      if (downsample < 1 || spacing < 0)
+        throw std::invalid_argument ("invalid montage parameters");
+      const int num_images = images.size();
+      if (!num_images)
+        return Image<T> (0, 0);
+
+      if (columns <= 0)
+        columns = static_cast<int> (std::ceil (std::sqrt (double (num_images))));
+      columns = std::min (columns, num_images);
+      const int rows = ( num_images + columns - 1 ) / columns;
+
+      int tile_width = 0, tile_height = 0;
+      std::size_t total = 0;
+      for (const auto& image : images) {
+        tile_width = std::max (tile_width, ( image.width() + downsample - 1 ) / downsample);
+        tile_height = std::max (tile_height, ( image.height() + downsample - 1 ) / downsample);
+        total += std::size_t (image.width()) * image.height();
+      }
+      const int x_step = tile_width + spacing, y_step = tile_height + spacing;
+      Image<T> canvas (columns * x_step - spacing, rows * y_step - spacing);
+
+      // each row of the canvas averages the corresponding rows of the images
+      // in that row of tiles, with partial blocks at the image edges:
+      run_in_chunks (canvas.height(), number_of_chunks (total), [&] (int, std::size_t begin, std::size_t end) {
+          std::vector<double> sums;
+          for (int y = begin; y < static_cast<int> (end); ++y) {
+            const int row = y / y_step, ty = y % y_step;
+            if (ty >= tile_height)
+              continue;
+            for (int column = 0; column < columns; ++column) {
+              const int index = row * columns + column;
+              if (index >= num_images)
+                break;
+              const auto& image = images[index];
+              const int y0 = ty * downsample, y1 = std::min (y0 + downsample, image.height());
+              if (y0 >= y1)
+                continue;
+              T* out = canvas.data() + std::size_t (y) * canvas.width() + column * x_step;
+              const int width = image.width();
+              if (downsample == 1) {
+                for (int x = 0; x < width; ++x)
+                  out[x] = image (x, y0);
+                continue;
+              }
+              sums.assign (width, 0.0);
+              for (int sy = y0; sy < y1; ++sy)
+                for (int x = 0; x < width; ++x)
+                  sums[x] += image (x, sy);
+              for (int x0 = 0; x0 < width; x0 += downsample) {
+                const int x1 = std::min (x0 + downsample, width);
+                double sum = 0.0;
+                for (int x = x0; x < x1; ++x)
+                  sum += sums[x];
+                out[x0 / downsample] = round_to<T> (sum / ( ( x1 - x0 ) * ( y1 - y0 ) ));
+              }
+            }
+          }
+        });
+      return canvas;
+    }
+
+
+
+  template <typename T>
+    inline Image<T> montage (const Volume<T>& volume, Orientation orientation, int downsample, int columns, int spacing)
+    {
+      const int num_slices = orientation == Orientation::AXIAL ? volume.depth() :
+        ( orientation == Orientation::CORONAL ? volume.height() : volume.width() );
+      std::vector<VolumeSlice<T>> slices;
+      slices.reserve (num_slices);
+      for (int n = 0; n < num_slices; ++n)
+        slices.push_back (volume.slice (orientation, n));
+      return montage (slices, downsample, columns, spacing);
+    }
+
+
+
+
+  // **************************************************************************
+  //                   imshow implementation
+  // **************************************************************************
+
+
+
+
+  // functions in anonymous namespace will remain private to this file:
+  namespace {
+
+    // helper functions for colourmap handling:
+
+    inline std::string colourmap_specifier (const ColourMap& colours)
     {
       int n = 0;
       std::string specifier;
@@ -1120,30 +6771,30 @@ namespace TG {
 
 
 
-    inline void commit (std::stringstream& out, ctype current, int repeats)
+    inline void commit (std::string& out, ctype current, int repeats)
     {
-      if (repeats <=3) {
-        for (int n = 0; n < repeats; ++n)
-          out.put (63+current);
-      }
+      if (repeats <=3)
+        out.append (repeats, char(63+current));
       else
-        out << std::format ("!{}{}", repeats, char(63+current));
+        out += std::format ("!{}{}", repeats, char(63+current));
     }
 
 
-    template <class ImageType>
-    inline std::string encode_row (const ImageType& im, int y0, int x_dim, int nsixels, const ctype intensity)
+    // encode the sixel row for one intensity, from the values of a band of
+    // `nsixels` rows, stored row by row:
+    template <typename ValueType>
+    inline std::string encode_row (const ValueType* band, int x_dim, int nsixels, const int intensity)
     {
       int repeats = 0;
-      std::stringstream out;
+      std::string out;
       // Reserve worst case: each pixel needs up to 5 chars ("!255" + value)
-      out.str().reserve(x_dim * 5);
+      out.reserve(x_dim * 5);
       ctype current = std::numeric_limits<ctype>::max();
 
       for (int x = 0; x < x_dim; ++x) {
         ctype c = 0;
         for (int y = 0; y < nsixels; ++y) {
-          if (im(x,y+y0) == intensity)
+          if (band[x + y*x_dim] == intensity)
             c |= 1U<<y;
         }
         if (!repeats) {
@@ -1161,30 +6812,122 @@ namespace TG {
       }
       commit (out, current, repeats);
 
-      return out.str();
+      return out;
     }
 
 
+    // encode a band of 6 rows from their runs: the band is split into
+    // segments over which each of its rows is constant, and each segment
+    // only contributes to the sixel rows of the colours present within it.
+    // Colours absent from the band are omitted entirely:
     template <class ImageType>
-      inline std::string encode (const ImageType& im, int cmap_size, int y0)
+      inline std::string encode_from_runs (const ImageType& im, int cmap_size, int y0)
       {
-        std::string out;
-        // Reserve worst case: each intensity might need a row
-        // Each row might need: "#" + intensity + "$" + encoded_row + "-"
-        out.reserve(cmap_size * (2 + im.width() * 5));
         const int nsixels = std::min (im.height()-y0, 6);
+        using Runs = decltype (im.row_runs (0));
+        std::vector<Runs> rows;
+        for (int y = 0; y < nsixels; ++y)
+          rows.push_back (im.row_runs (y0+y));
+
+        struct SixelRow { std::string out; int end = 0, repeats = 0; ctype current = 0; };
+        std::vector<SixelRow> sixel_rows (cmap_size);
+        std::vector<int> colours;
+        auto add = [&] (SixelRow& row, ctype c, int repeats) {
+          if (row.repeats && c == row.current) {
+            row.repeats += repeats;
+            return;
+          }
+          if (row.repeats)
+            commit (row.out, row.current, row.repeats);
+          row.current = c;
+          row.repeats = repeats;
+        };
+
+        std::array<std::size_t,6> index = { };
+        std::array<int,6> run_end = { };
+        for (int y = 0; y < nsixels; ++y)
+          run_end[y] = std::ranges::begin (rows[y]) == std::ranges::end (rows[y]) ? im.width() : std::ranges::begin (rows[y])->second;
+        for (int x = 0; x < im.width(); ) {
+          const int end = *std::min_element (run_end.begin(), run_end.begin() + nsixels);
+          unsigned int done = 0;
+          for (int y = 0; y < nsixels; ++y) {
+            if (done & (1U<<y))
+              continue;
+            const auto value = std::ranges::begin (rows[y])[index[y]].first;
+            ctype c = 0;
+            for (int y2 = y; y2 < nsixels; ++y2) {
+              if (std::ranges::begin (rows[y2])[index[y2]].first == value)
+                c |= 1U<<y2;
+            }
+            done |= c;
+            // as for encode_row(), only values matching a colour index are drawn:
+            const double colour = value;
+            if (!( colour >= 0.0 && colour < cmap_size ) || colour != std::floor (colour))
+              continue;
+            auto& row = sixel_rows[static_cast<int> (colour)];
+            if (!row.repeats)
+              colours.push_back (colour);
+            if (x > row.end)
+              add (row, 0, x - row.end);
+            add (row, c, end - x);
+            row.end = end;
+          }
+          x = end;
+          for (int y = 0; y < nsixels; ++y) {
+            if (run_end[y] == x && x < im.width())
+              run_end[y] += std::ranges::begin (rows[y])[++index[y]].second;
+          }
+        }
+
+        std::ranges::sort (colours);
+        std::string out;
+        for (const int colour : colours) {
+          auto& row = sixel_rows[colour];
+          commit (row.out, row.current, row.repeats);
+          if (!out.empty())
+            out += '$';
+          out += std::format ("#{}{}", colour, row.out);
+        }
+        out += '-';
+        return out;
+      }
+
+
+    template <class ImageType>
+      inline std::string encode (const ImageType& im, int cmap_size, int y0)
+      {
+        if constexpr (HasRowRuns<ImageType>)
+          return encode_from_runs (im, cmap_size, y0);
+        else {
+          // read the band once, & note which colours are present in it, so
+          // that only their rows need to be encoded:
+          using value_type = std::remove_cvref_t<decltype(im(0,0))>;
+          const int x_dim = im.width();
+          const int nsixels = std::min (im.height()-y0, 6);
+          std::vector<value_type> band (std::size_t (x_dim) * nsixels);
+          std::vector<char> present (cmap_size, 0);
+          for (int y = 0; y < nsixels; ++y) {
+            for (int x = 0; x < x_dim; ++x) {
+              const value_type value = im(x,y+y0);
+              band[x + y*x_dim] = value;
+              const double colour = value;
+              if (colour >= 0.0 && colour < cmap_size && colour == std::floor (colour))
+                present[static_cast<int> (colour)] = 1;
+            }
+          }
 
-        bool first = true;
-        for (ctype intensity = 0; intensity < cmap_size; ++intensity) {
-          std::string row = encode_row (im, y0, im.width(), nsixels, intensity);
-          if (row.size()) {
+          std::string out;
+          bool first = true;
+          for (int intensity = 0; intensity < cmap_size; ++intensity) {
+            if (!present[intensity])
+              continue;
             if (first) first = false;
             else out += '$';
-            out += std::format ("#{}{}", static_cast<int>(intensity), row);
+            out += std::format ("#{}{}", intensity, encode_row (band.data(), x_dim, nsixels, intensity));
           }
+          out += '-';
+          return out;
         }
-        out += '-';
-        return out;
       }
 
   }
@@ -1196,12 +6939,30 @@ namespace TG {
 
 
   template <class ImageType>
-    inline void imshow (const ImageType& image, const ColourMap& cmap)
+    inline std::string sixel_encode (const ImageType& image, const ColourMap& cmap)
     {
       std::string out = "\033P9q" + colourmap_specifier (cmap);
       for (int y = 0; y < image.height(); y += 6)
         out += encode (image, cmap.size(), y);
       out += "\033\\\n";
+      return out;
+    }
+
+
+
+  template <class ImageType>
+    inline std::string sixel_encode (const ImageType& image, double min, double max, const ColourMap& cmap)
+    {
+      Rescale<ImageType> rescaled (image, min, max, cmap.size());
+      return sixel_encode (rescaled, cmap);
+    }
+
+
+
+  template <class ImageType>
+    inline void imshow (const ImageType& image, const ColourMap& cmap)
+    {
+      const std::string out = sixel_encode (image, cmap);
       std::cout.write (out.data(), out.size());
       std::cout.flush();
     }
@@ -1217,9 +6978,362 @@ namespace TG {
 
 
 
+  // **************************************************************************
+  //                   auto-window implementation
+  // **************************************************************************
+
+  namespace {
+
+    // order-preserving 16-bit key for any arithmetic value, based on the
+    // leading bits of its single-precision floating-point representation:
+    inline unsigned int window_key (float value)
+    {
+      unsigned int bits = std::bit_cast<unsigned int> (value);
+      bits = ( bits & 0x80000000U ) ? ~bits : ( bits | 0x80000000U );
+      return bits >> 16;
+    }
+
+    // smallest & largest float values that map to the key supplied:
+    inline std::array<float,2> window_key_range (unsigned int key)
+    {
+      std::array<unsigned int,2> bits = { key << 16, ( key << 16 ) | 0xFFFFU };
+      std::array<float,2> range;
+      for (int n = 0; n < 2; ++n)
+        range[n] = std::bit_cast<float> (( bits[n] & 0x80000000U ) ? ( bits[n] & 0x7FFFFFFFU ) : ~bits[n]);
+      return { std::min (range[0], range[1]), std::max (range[0], range[1]) };
+    }
+
+    // locate the bins containing the requested percentiles:
+    template <class HistogramType>
+    inline std::array<std::size_t,2> percentile_bins (const HistogramType& histogram,
+        std::size_t total, double lower, double upper)
+    {
+      const double rank[2] = {
+        std::floor (std::clamp (lower, 0.0, 100.0) * (total-1) / 100.0),
+        std::ceil (std::clamp (upper, 0.0, 100.0) * (total-1) / 100.0) };
+      std::array<std::size_t,2> bins = { 0, histogram.size()-1 };
+      std::size_t cumulative = 0;
+      bool found_lower = false;
+      for (std::size_t n = 0; n < histogram.size(); ++n) {
+        cumulative += histogram[n];
+        if (!found_lower && cumulative > rank[0]) {
+          bins[0] = n;
+          found_lower = true;
+        }
+        if (cumulative > rank[1]) {
+          bins[1] = n;
+          break;
+        }
+      }
+      return bins;
+    }
+
+    inline Window valid_window (Window window)
+    {
+      if (!std::isfinite (window.min) || !std::isfinite (window.max))
+        return { 0.0, 1.0 };
+      if (window.max <= window.min)
+        window.max = window.min + 1.0;
+      return window;
+    }
+
+    // accumulate a separate state per thread over the values of an image,
+    // via accumulate (state, value), then pass each to combine (state):
+    template <class ImageType, class State, class Accumulate, class Combine>
+      inline void accumulate_over_rows (const ImageType& image, const State& initial,
+          Accumulate&& accumulate, Combine&& combine)
+      {
+        const int nchunks = number_of_chunks (std::size_t (image.width()) * image.height());
+        std::vector<std::optional<State>> states (number_of_slots (nchunks));
+        run_in_chunks (image.height(), nchunks, [&] (int slot, std::size_t begin, std::size_t end) {
+            auto& state = states[slot];
+            if (!state)
+              state = initial;
+            for (int y = begin; y < static_cast<int>(end); ++y)
+              for (int x = 0; x < image.width(); ++x)
+                accumulate (*state, image(x,y));
+          }, states.size());
+        for (const auto& state : states)
+          if (state)
+            combine (*state);
+      }
+
+  }
+
+
+
+
+  template <class ImageType>
+    inline Window auto_window (const ImageType& image, double lower, double upper)
+    {
+      using T = pixel_type<ImageType>;
+      static_assert (std::is_arithmetic_v<T>, "auto_window() requires a scalar image");
+
+      if constexpr (has_direct_histogram<T>) {
+        constexpr long offset = std::numeric_limits<T>::min();
+        constexpr std::size_t nbins = std::size_t(1) << (8*sizeof(T));
+        std::vector<std::size_t> histogram;
+        if constexpr (std::is_same_v<ImageType, Image<T>>) {
+          const auto counts = compute_histogram (image, nbins, offset, offset + double (nbins));
+          histogram.assign (counts.begin(), counts.end());
+        }
+        else {
+          histogram.assign (nbins, 0);
+          accumulate_over_rows (image, std::vector<std::size_t> (nbins, 0),
+              [] (std::vector<std::size_t>& counts, T val) { ++counts[static_cast<long>(val) - offset]; },
+              [&] (const std::vector<std::size_t>& counts) {
+              for (std::size_t n = 0; n < nbins; ++n)
+                histogram[n] += counts[n];
+              });
+        }
+
+        const std::size_t total = std::size_t(image.width()) * image.height();
+        if (!total)
+          return valid_window ({ NAN, NAN });
+        const auto bins = percentile_bins (histogram, total, lower, upper);
+        return valid_window ({ double (long (bins[0]) + offset), double (long (bins[1]) + offset) });
+      }
+      else {
+        constexpr std::size_t nbins = std::size_t(1) << 16;
+        std::vector<std::size_t> histogram (nbins, 0);
+        std::size_t total = 0;
+        float min = std::numeric_limits<float>::infinity();
+        float max = -min;
+        struct Partial {
+          std::vector<std::size_t> histogram;
+          float min, max;
+          std::size_t total;
+        };
+        accumulate_over_rows (image, Partial { std::vector<std::size_t> (nbins, 0), min, max, 0 },
+            [] (Partial& partial, float val) {
+            if (!std::isfinite (val))
+              return;
+            ++partial.histogram[window_key (val)];
+            partial.min = std::min (partial.min, val);
+            partial.max = std::max (partial.max, val);
+            ++partial.total;
+            },
+            [&] (const Partial& partial) {
+            for (std::size_t n = 0; n < nbins; ++n)
+              histogram[n] += partial.histogram[n];
+            min = std::min (min, partial.min);
+            max = std::max (max, partial.max);
+            total += partial.total;
+            });
+
+        if (!total)
+          return valid_window ({ NAN, NAN });
+        const auto bins = percentile_bins (histogram, total, lower, upper);
+        return valid_window ({
+            std::max (window_key_range (bins[0])[0], min),
+            std::min (window_key_range (bins[1])[1], max) });
+      }
+    }
+
+
+
+
+  inline AutoWindow::AutoWindow (double lower, double upper, double smoothing) :
+    lower (lower), upper (upper), smoothing (std::clamp (smoothing, 0.0, 1.0)),
+    current ({ 0.0, 1.0 }), initialised (false) { }
+
+  inline const Window& AutoWindow::window () const { return current; }
+
+  inline void AutoWindow::reset () { initialised = false; }
+
+  template <class ImageType>
+    inline const Window& AutoWindow::update (const ImageType& image)
+    {
+      using T = pixel_type<ImageType>;
+
+      // number of bins used to sample the range around the previous window,
+      // and how far either side of it to extend that range:
+      constexpr int nbins = 4096;
+      constexpr double margin = 0.5;
+
+      std::optional<Window> measured;
+      if (initialised && !has_direct_histogram<T>) {
+        const double extent = current.max - current.min;
+        const double from = current.min - margin*extent;
+        const double scale = nbins / ( ( 1.0 + 2.0*margin ) * extent );
+
+        // histogram with an extra bin either side to catch outliers, and
+        // the total number of finite values in the last entry:
+        std::vector<std::size_t> histogram (nbins+2, 0);
+        std::size_t total = 0;
+        accumulate_over_rows (image, std::vector<std::size_t> (nbins+3, 0),
+            [from, scale] (std::vector<std::size_t>& counts, double val) {
+            if (!std::isfinite (val))
+              return;
+            ++counts[static_cast<std::size_t> (std::clamp (std::floor (( val - from ) * scale) + 1.0, 0.0, nbins+1.0))];
+            ++counts[nbins+2];
+            },
+            [&] (const std::vector<std::size_t>& counts) {
+            for (int n = 0; n < nbins+2; ++n)
+              histogram[n] += counts[n];
+            total += counts[nbins+2];
+            });
+
+        if (total) {
+          const auto bins = percentile_bins (histogram, total, lower, upper);
+          if (bins[0] > 0 && bins[1] <= nbins)
+            measured = Window { from + ( bins[0]-1 ) / scale, from + bins[1] / scale };
+        }
+      }
+
+      if (!measured)
+        measured = auto_window (image, lower, upper);
+
+      if (initialised)
+        current = valid_window ({
+            smoothing * current.min + ( 1.0-smoothing ) * measured->min,
+            smoothing * current.max + ( 1.0-smoothing ) * measured->max });
+      else
+        current = *measured;
+      initialised = true;
+
+      return current;
+    }
+
+
+
+
+  template <class ImageType>
+    inline void imshow (const ImageType& image, const Window& window, const ColourMap& cmap)
+    {
+      imshow (image, window.min, window.max, cmap);
+    }
+
+
+
+
+
 
 
 
+  // **************************************************************************
+  //                   Player implementation
+  // **************************************************************************
+
+  inline Player::Player (double fps, int buffer_size) :
+    fps (fps), buffer_size (buffer_size)
+  {
+    if (!( fps > 0.0 ))
+      throw std::invalid_argument ("frame rate must be positive");
+    if (buffer_size < 1)
+      throw std::invalid_argument ("buffer size must be at least one frame");
+  }
+
+
+
+  template <class FrameSource>
+    inline Player::Statistics Player::play (int num_frames, FrameSource&& frame, double min, double max, const ColourMap& cmap) const
+    {
+      using clock = std::chrono::steady_clock;
+      Statistics stats;
+      if (num_frames <= 0)
+        return stats;
+
+      // ring buffer of encoded frames, with the time taken to produce each:
+      std::vector<std::pair<std::string,double>> ring (buffer_size);
+      int produced = 0, consumed = 0;
+      bool stop = false;
+      std::exception_ptr error;
+      std::mutex mutex;
+      std::condition_variable cond;
+
+      std::thread producer ([&] {
+          try {
+            for (int n = 0; n < num_frames; ++n) {
+              {
+                std::unique_lock<std::mutex> lock (mutex);
+                cond.wait (lock, [&] { return stop || produced - consumed < buffer_size; });
+                if (stop)
+                  return;
+              }
+              const auto start = clock::now();
+              std::string encoded = sixel_encode (frame (n), min, max, cmap);
+              const double ms = std::chrono::duration<double,std::milli> (clock::now() - start).count();
+
+              std::lock_guard<std::mutex> lock (mutex);
+              ring[n % buffer_size] = { std::move (encoded), ms };
+              ++produced;
+              cond.notify_all();
+            }
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> lock (mutex);
+            error = std::current_exception();
+            cond.notify_all();
+          }
+        });
+
+      auto finish = [&] {
+        {
+          std::lock_guard<std::mutex> lock (mutex);
+          stop = true;
+          cond.notify_all();
+        }
+        producer.join();
+      };
+
+      const auto interval = std::chrono::duration<double> (1.0 / fps);
+      const auto start = clock::now();
+      try {
+        for (int n = 0; n < num_frames; ++n) {
+          std::string encoded;
+          bool next_ready;
+          {
+            std::unique_lock<std::mutex> lock (mutex);
+            cond.wait (lock, [&] { return error || produced > n; });
+            if (error)
+              break;
+            encoded = std::move (ring[n % buffer_size].first);
+            const double ms = ring[n % buffer_size].second;
+            stats.mean_encode_ms += ms;
+            stats.max_encode_ms = std::max (stats.max_encode_ms, ms);
+            ++consumed;
+            next_ready = produced > n+1;
+            cond.notify_all();
+          }
+
+          // drop this frame if the next one is ready & already due:
+          if (next_ready && clock::now() > start + ( n+1 ) * interval) {
+            ++stats.frames_dropped;
+            continue;
+          }
+          std::this_thread::sleep_until (start + std::chrono::duration_cast<clock::duration> (n * interval));
+          std::cout << Home;
+          std::cout.write (encoded.data(), encoded.size());
+          std::cout.flush();
+          ++stats.frames_shown;
+        }
+      }
+      catch (...) {
+        finish();
+        throw;
+      }
+      finish();
+      if (error)
+        std::rethrow_exception (error);
+
+      stats.mean_encode_ms /= num_frames;
+      stats.frame_rate = stats.frames_shown / std::chrono::duration<double> (clock::now() - start).count();
+      return stats;
+    }
+
+
+
+  template <typename T>
+    inline Player::Statistics Player::play (const Volume<T>& volume, Orientation orientation,
+        double min, double max, const ColourMap& cmap) const
+    {
+      const int num_slices = orientation == Orientation::AXIAL ? volume.depth() :
+        ( orientation == Orientation::CORONAL ? volume.height() : volume.width() );
+      return play (num_slices, [&] (int n) { return volume.slice (orientation, n); }, min, max, cmap);
+    }
+
+
 
 
   // **************************************************************************